@@ -0,0 +1,208 @@
+#include "tileregion.h"
+
+#include <QList>
+#include <QTest>
+
+#include <algorithm>
+
+using namespace KWin;
+
+/**
+ * Replays the damage bookkeeping of prePaintWindow for one frame of a cascaded 4K desktop, with QRegion and with
+ * TileRegion as the accumulated regions. Both runs go through the same helpers as the effect, so the TileRegion run
+ * includes converting the regions of every window and converting the currently blurred area back whenever it's added
+ * to the paint region of a window.
+ */
+class TileRegionBenchmark : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void replay_data();
+    void replay();
+    void tilesCoverExactDamage_data();
+    void tilesCoverExactDamage();
+
+private:
+    /// What prePaintWindow gets for a window after the blur and opaque regions were resolved.
+    struct PrePaintWindow
+    {
+        QRegion opaque;
+        QRegion paint;
+        QRegion translucentBlurArea;
+        int expandSize = 0;
+    };
+
+    /**
+     * @param windowCount Number of cascaded windows, every third one is blurred.
+     * @param damagedWindow Index of the window whose contents changed, -1 if only the cursor blinks on the top one.
+     */
+    static QList<PrePaintWindow> cascade(int windowCount, int damagedWindow);
+    /// @return The window with the corners of its opaque and blur regions cut out, like with rounded corners.
+    static QRegion roundedRect(const QRect &rect, int radius);
+
+    /**
+     * Runs the accumulator updates of prePaintWindow on the windows from bottom to top.
+     * @return The paint regions of the windows.
+     */
+    template<typename Region>
+    static QList<QRegion> replayFrame(QList<PrePaintWindow> windows, Region paintedArea, Region currentBlur);
+
+    static QList<QRegion> replayFrame(const QList<PrePaintWindow> &windows, bool tiles);
+
+    static inline const QRect s_screen{0, 0, 3840, 2160};
+};
+
+QRegion TileRegionBenchmark::roundedRect(const QRect &rect, int radius)
+{
+    QRegion region(rect);
+    // Approximated with a few steps per corner, which is about as many rects as the corner cutouts of the effect.
+    for (int step = 0; step < 4; ++step) {
+        const int inset = radius * (4 - step) / 4;
+        const int height = radius / 4;
+        const int y = step * height;
+        region -= QRect(rect.left(), rect.top() + y, inset, height);
+        region -= QRect(rect.right() - inset + 1, rect.top() + y, inset, height);
+        region -= QRect(rect.left(), rect.bottom() - y - height + 1, inset, height);
+        region -= QRect(rect.right() - inset + 1, rect.bottom() - y - height + 1, inset, height);
+    }
+    return region;
+}
+
+QList<TileRegionBenchmark::PrePaintWindow> TileRegionBenchmark::cascade(int windowCount, int damagedWindow)
+{
+    QList<PrePaintWindow> windows;
+    // The desktop.
+    windows.append(PrePaintWindow{
+        .opaque = s_screen,
+    });
+
+    for (int i = 0; i < windowCount; ++i) {
+        const QRect geometry = QRect(QPoint(80 + (i * 90) % 1800, 60 + (i * 50) % 900), QSize(1600, 1000));
+        PrePaintWindow window;
+        if (i % 3 == 0) {
+            // A terminal or panel with a translucent background and an opaque title bar.
+            window.translucentBlurArea = roundedRect(geometry, 12);
+            window.opaque = QRect(geometry.topLeft(), QSize(geometry.width(), 36)).adjusted(12, 0, -12, 0);
+            window.expandSize = 24;
+        } else {
+            window.opaque = roundedRect(geometry, 12);
+        }
+        if (i == damagedWindow) {
+            // A playing video.
+            window.paint = QRect(geometry.topLeft() + QPoint(200, 150), QSize(1280, 720));
+        }
+        windows.append(window);
+    }
+
+    if (damagedWindow == -1) {
+        const QRect top = windows.constLast().opaque.boundingRect();
+        windows.last().paint = QRect(top.center(), QSize(2, 18));
+    }
+    return windows;
+}
+
+template<typename Region>
+QList<QRegion> TileRegionBenchmark::replayFrame(QList<PrePaintWindow> windows, Region paintedArea, Region currentBlur)
+{
+    QList<QRegion> paint;
+    int currentBlurExpandSize = 0;
+    for (PrePaintWindow &data : windows) {
+        const auto blurDamage = damageArea(currentBlur, data.translucentBlurArea);
+        const QRegion oldOpaque = data.opaque;
+        if (currentBlur.intersects(damageArea(currentBlur, data.opaque))) {
+            QRegion newOpaque;
+            for (const QRect &rect : data.opaque) {
+                newOpaque += rect.adjusted(currentBlurExpandSize, currentBlurExpandSize, -currentBlurExpandSize, -currentBlurExpandSize);
+            }
+            data.opaque = newOpaque;
+            currentBlur -= coveredArea(currentBlur, newOpaque);
+        }
+
+        bool repaintCurrentBlur = currentBlur.intersects(damageArea(currentBlur, data.paint - oldOpaque));
+        const bool blurIntersectsCurrentBlur = currentBlur.intersects(blurDamage);
+        if (paintedArea.intersects(blurDamage) || data.paint.intersects(data.translucentBlurArea)
+            || (repaintCurrentBlur && blurIntersectsCurrentBlur)) {
+            data.paint += data.translucentBlurArea;
+            repaintCurrentBlur |= blurIntersectsCurrentBlur;
+        }
+        if (repaintCurrentBlur) {
+            data.paint += toRegion(currentBlur);
+        }
+
+        currentBlur |= blurDamage;
+        if (!data.translucentBlurArea.isEmpty()) {
+            currentBlurExpandSize = std::max(currentBlurExpandSize, data.expandSize);
+        }
+
+        paintedArea -= coveredArea(paintedArea, data.opaque);
+        paintedArea |= damageArea(paintedArea, data.paint);
+        paint.append(data.paint);
+    }
+    return paint;
+}
+
+QList<QRegion> TileRegionBenchmark::replayFrame(const QList<PrePaintWindow> &windows, bool tiles)
+{
+    if (tiles) {
+        return replayFrame(windows, TileRegion(s_screen, QRegion(), TileRegion::Rounding::Outwards), TileRegion(s_screen, QRegion(), TileRegion::Rounding::Outwards));
+    }
+    return replayFrame(windows, QRegion(), QRegion());
+}
+
+void TileRegionBenchmark::replay_data()
+{
+    QTest::addColumn<bool>("tiles");
+    QTest::addColumn<int>("windowCount");
+    QTest::addColumn<int>("damagedWindow");
+
+    for (const bool tiles : {false, true}) {
+        const char *type = tiles ? "TileRegion" : "QRegion";
+        QTest::addRow("%s, 12 windows, cursor", type) << tiles << 12 << -1;
+        QTest::addRow("%s, 12 windows, video below blur", type) << tiles << 12 << 4;
+        QTest::addRow("%s, 48 windows, cursor", type) << tiles << 48 << -1;
+        QTest::addRow("%s, 48 windows, video below blur", type) << tiles << 48 << 16;
+    }
+}
+
+void TileRegionBenchmark::replay()
+{
+    QFETCH(bool, tiles);
+    QFETCH(int, windowCount);
+    QFETCH(int, damagedWindow);
+    const QList<PrePaintWindow> windows = cascade(windowCount, damagedWindow);
+
+    QList<QRegion> paint;
+    QBENCHMARK {
+        paint = replayFrame(windows, tiles);
+    }
+    QCOMPARE(paint.size(), windows.size());
+}
+
+void TileRegionBenchmark::tilesCoverExactDamage_data()
+{
+    QTest::addColumn<int>("windowCount");
+    QTest::addColumn<int>("damagedWindow");
+
+    QTest::addRow("cursor") << 12 << -1;
+    QTest::addRow("video below blur") << 12 << 4;
+    QTest::addRow("video above blur") << 12 << 5;
+}
+
+void TileRegionBenchmark::tilesCoverExactDamage()
+{
+    QFETCH(int, windowCount);
+    QFETCH(int, damagedWindow);
+    const QList<PrePaintWindow> windows = cascade(windowCount, damagedWindow);
+
+    // Tiles may only make the paint regions larger, they must never miss an area that has to be repainted.
+    const QList<QRegion> exact = replayFrame(windows, false);
+    const QList<QRegion> tiled = replayFrame(windows, true);
+    for (qsizetype i = 0; i < exact.size(); ++i) {
+        QVERIFY2((exact[i] - tiled[i]).isEmpty(), qPrintable(QStringLiteral("window %1").arg(i)));
+    }
+}
+
+QTEST_GUILESS_MAIN(TileRegionBenchmark)
+
+#include "tileregionbenchmark.moc"
@@ -0,0 +1,183 @@
+#include "windowtable.h"
+
+#include <QDebug>
+#include <QList>
+#include <QRandomGenerator>
+#include <QRegion>
+#include <QTest>
+
+#include <algorithm>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+using namespace KWin;
+
+/**
+ * Compares the per-window state lookups done while painting with the maps used before WindowTable and with
+ * WindowTable. Every frame, the windows are walked in stacking order and looked up as many times as blurRegion,
+ * hasStaticBlur, prePaintWindow and shouldBlur do, then the blurred windows are iterated like when updating the
+ * window behind state.
+ */
+class WindowTableBenchmark : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void maps_data();
+    void maps();
+    void windowTable_data();
+    void windowTable();
+
+private:
+    /// Stands in for BlurEffectData, which has a few regions and the render data.
+    struct BlurData
+    {
+        QRegion content;
+        QRegion frame;
+        QRegion windowBehind;
+        char renderData[256] = {};
+    };
+
+    struct Record
+    {
+        std::optional<BlurData> blur;
+    };
+
+    enum Flag : uint8_t {
+        HasBlur = 1 << 0,
+        BlurWhenTransformed = 1 << 1,
+        WindowClassMatches = 1 << 3,
+        HasWindowBehind = 1 << 4,
+    };
+
+    void addData();
+    /**
+     * @return Fake window pointers in stacking order. They're only used as keys.
+     */
+    std::vector<EffectWindow *> createWindows(int count);
+
+    static constexpr int s_lookupsPerWindow = 4;
+    std::vector<char> m_windowStorage;
+};
+
+void WindowTableBenchmark::addData()
+{
+    QTest::addColumn<int>("windowCount");
+
+    QTest::newRow("10 windows") << 10;
+    QTest::newRow("100 windows") << 100;
+    QTest::newRow("500 windows") << 500;
+}
+
+std::vector<EffectWindow *> WindowTableBenchmark::createWindows(int count)
+{
+    m_windowStorage.assign(count * 64, 0);
+    std::vector<EffectWindow *> windows;
+    for (int i = 0; i < count; ++i) {
+        windows.push_back(reinterpret_cast<EffectWindow *>(m_windowStorage.data() + i * 64));
+    }
+    // The stacking order differs from the order the windows were added in.
+    QRandomGenerator random(1);
+    std::shuffle(windows.begin(), windows.end(), random);
+    return windows;
+}
+
+void WindowTableBenchmark::maps_data()
+{
+    addData();
+}
+
+void WindowTableBenchmark::maps()
+{
+    QFETCH(int, windowCount);
+    const std::vector<EffectWindow *> windows = createWindows(windowCount);
+
+    std::unordered_map<EffectWindow *, BlurData> blurData;
+    QList<const EffectWindow *> blurWhenTransformed;
+    std::unordered_map<const EffectWindow *, bool> windowClassMatches;
+    for (int i = 0; i < windowCount; ++i) {
+        if (i % 2 == 0) {
+            blurData[windows[i]] = BlurData();
+        }
+        if (i % 8 == 0) {
+            blurWhenTransformed.append(windows[i]);
+        }
+        windowClassMatches[windows[i]] = i % 4 == 0;
+    }
+
+    // Counted so that the lookups aren't optimized out.
+    int hits = 0;
+    QBENCHMARK {
+        for (EffectWindow *w : windows) {
+            for (int i = 0; i < s_lookupsPerWindow; ++i) {
+                if (blurData.find(w) != blurData.end()) {
+                    ++hits;
+                }
+            }
+            if (blurWhenTransformed.contains(w)) {
+                ++hits;
+            }
+            if (const auto it = windowClassMatches.find(w); it != windowClassMatches.end() && it->second) {
+                ++hits;
+            }
+        }
+        for (const auto &[w, data] : blurData) {
+            if (!data.windowBehind.isEmpty()) {
+                ++hits;
+            }
+        }
+    }
+    qDebug() << hits << "hits";
+}
+
+void WindowTableBenchmark::windowTable_data()
+{
+    addData();
+}
+
+void WindowTableBenchmark::windowTable()
+{
+    QFETCH(int, windowCount);
+    const std::vector<EffectWindow *> windows = createWindows(windowCount);
+
+    WindowTable<Record> table;
+    for (int i = 0; i < windowCount; ++i) {
+        const auto index = table.insert(windows[i]);
+        if (i % 2 == 0) {
+            table.record(index).blur = BlurData();
+            table.setFlag(index, HasBlur);
+        }
+        table.setFlag(index, BlurWhenTransformed, i % 8 == 0);
+        table.setFlag(index, WindowClassMatches, i % 4 == 0);
+    }
+
+    // Counted so that the lookups aren't optimized out.
+    int hits = 0;
+    QBENCHMARK {
+        for (EffectWindow *w : windows) {
+            for (int i = 0; i < s_lookupsPerWindow; ++i) {
+                if (const auto index = table.find(w); index != table.InvalidIndex && table.testFlag(index, HasBlur)) {
+                    ++hits;
+                }
+            }
+            const auto index = table.find(w);
+            if (table.testFlag(index, BlurWhenTransformed)) {
+                ++hits;
+            }
+            if (table.testFlag(index, WindowClassMatches)) {
+                ++hits;
+            }
+        }
+        for (auto index = 0u; index < table.slotCount(); ++index) {
+            if (table.testFlag(index, HasBlur) && table.testFlag(index, HasWindowBehind)) {
+                ++hits;
+            }
+        }
+    }
+    qDebug() << hits << "hits";
+}
+
+QTEST_GUILESS_MAIN(WindowTableBenchmark)
+
+#include "windowtablebenchmark.moc"
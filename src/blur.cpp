@@ -24,16 +24,25 @@
 #include "wayland/blur.h"
 #include "wayland/display.h"
 #include "wayland/surface.h"
+#include "x11window.h"
 
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFileInfo>
 #include <QGuiApplication>
 #include <QImage>
 #include <QMatrix4x4>
+#include <QPainter>
 #include <QScreen>
 #include <QTime>
 #include <QTimer>
 #include <QWindow>
+#include <algorithm>
+#include <bit>
 #include <cmath> // for ceil()
 #include <cstdlib>
+#include <cstring>
+#include <limits>
 
 #include <KConfigGroup>
 #include <KSharedConfig>
@@ -55,6 +64,14 @@ namespace KWin
 
 static const QByteArray s_blurAtomName = QByteArrayLiteral("_KDE_NET_WM_BLUR_BEHIND_REGION");
 
+/// The size of the tiles in which static blur textures are updated, in texture pixels.
+static const int s_staticBlurTileSize = 128;
+
+/// The width of desktop fingerprints in pixels.
+static const int s_fingerprintWidth = 64;
+/// The average difference of a color channel in a cell above which the desktop is considered changed, from 0 to 255.
+static const int s_fingerprintThreshold = 6;
+
 BlurManagerInterface *BlurEffect::s_blurManager = nullptr;
 QTimer *BlurEffect::s_blurManagerRemoveTimer = nullptr;
 
@@ -93,6 +110,7 @@ BlurEffect::BlurEffect()
         m_upsamplePass.noiseTextureSizeLocation = m_upsamplePass.shader->uniformLocation("noiseTextureSize");
         m_upsamplePass.topCornerRadiusLocation = m_upsamplePass.shader->uniformLocation("topCornerRadius");
         m_upsamplePass.bottomCornerRadiusLocation = m_upsamplePass.shader->uniformLocation("bottomCornerRadius");
+        m_upsamplePass.cornerRectLocation = m_upsamplePass.shader->uniformLocation("cornerRect");
         m_upsamplePass.antialiasingLocation = m_upsamplePass.shader->uniformLocation("antialiasing");
         m_upsamplePass.blurSizeLocation = m_upsamplePass.shader->uniformLocation("blurSize");
         m_upsamplePass.opacityLocation = m_upsamplePass.shader->uniformLocation("opacity");
@@ -101,6 +119,8 @@ BlurEffect::BlurEffect()
         m_upsamplePass.refractionNormalPowLocation = m_upsamplePass.shader->uniformLocation("refractionNormalPow");
         m_upsamplePass.refractionRGBFringingLocation = m_upsamplePass.shader->uniformLocation("refractionRGBFringing");
         m_upsamplePass.refractionTextureRepeatModeLocation = m_upsamplePass.shader->uniformLocation("refractionTextureRepeatMode");
+        m_upsamplePass.useShapeMaskLocation = m_upsamplePass.shader->uniformLocation("useShapeMask");
+        m_upsamplePass.shapeMaskLocation = m_upsamplePass.shader->uniformLocation("shapeMask");
     }
 
     m_texture.shader = ShaderManager::instance()->generateShaderFromFile(ShaderTrait::MapTexture,
@@ -116,8 +136,11 @@ BlurEffect::BlurEffect()
         m_texture.blurSizeLocation = m_texture.shader->uniformLocation("blurSize");
         m_texture.topCornerRadiusLocation = m_texture.shader->uniformLocation("topCornerRadius");
         m_texture.bottomCornerRadiusLocation = m_texture.shader->uniformLocation("bottomCornerRadius");
+        m_texture.cornerRectLocation = m_texture.shader->uniformLocation("cornerRect");
         m_texture.antialiasingLocation = m_texture.shader->uniformLocation("antialiasing");
         m_texture.opacityLocation = m_texture.shader->uniformLocation("opacity");
+        m_texture.useShapeMaskLocation = m_texture.shader->uniformLocation("useShapeMask");
+        m_texture.shapeMaskLocation = m_texture.shader->uniformLocation("shapeMask");
     }
 
     initBlurStrengthValues();
@@ -142,6 +165,21 @@ BlurEffect::BlurEffect()
         }
     }
 
+    m_staticBlurRecreateTimer.setSingleShot(true);
+    m_staticBlurRecreateTimer.setInterval(500);
+    m_staticBlurRecreateTimer.callOnTimeout(this, &BlurEffect::recreateOutdatedStaticBlurTextures);
+    // The work area is updated after the outputs and panels that change it.
+    m_blurStylesTimer.setSingleShot(true);
+    m_blurStylesTimer.callOnTimeout(this, &BlurEffect::updateBlurStyles);
+    // Coverage is updated lazily, since the stacking order may not be final yet when the signals are emitted.
+    m_activeStateTimer.setSingleShot(true);
+    m_activeStateTimer.callOnTimeout(this, &BlurEffect::updateActiveState);
+    // Windows use real blur until the custom image is ready.
+    connect(&m_customImageLoader, &StaticBlurImageLoader::imageLoaded, this, [this]() {
+        m_staticBlurDiskCacheMisses.clear();
+        effects->addRepaintFull();
+    });
+
     connect(effects, &EffectsHandler::windowAdded, this, &BlurEffect::slotWindowAdded);
     connect(effects, &EffectsHandler::windowDeleted, this, &BlurEffect::slotWindowDeleted);
     connect(effects, &EffectsHandler::screenAdded, this, &BlurEffect::slotScreenAdded);
@@ -149,9 +187,28 @@ BlurEffect::BlurEffect()
     connect(effects, &EffectsHandler::propertyNotify, this, &BlurEffect::slotPropertyNotify);
     connect(effects, &EffectsHandler::xcbConnectionChanged, this, [this]() {
         net_wm_blur_region = effects->announceSupportProperty(s_blurAtomName, this);
+        m_pendingX11BlurRegions.clear();
+        for (auto index = 0u; index < m_windows.slotCount(); ++index) {
+            m_windows.record(index).x11BlurRegionState = X11BlurRegionState::Unknown;
+        }
+        // The cached regions were read from the old connection.
+        requestX11BlurRegions();
+    });
+    connect(effects, &EffectsHandler::desktopChanged, this, &BlurEffect::rebuildWindowGrid);
+    connect(effects, &EffectsHandler::currentActivityChanged, this, &BlurEffect::rebuildWindowGrid);
+    connect(effects, &EffectsHandler::stackingOrderChanged, this, [this]() {
+        m_windowBehindDirty = true;
+        invalidateCoveredOutputs();
     });
+    connect(effects, &EffectsHandler::activeFullScreenEffectChanged, this, &BlurEffect::invalidateCoveredOutputs);
+    connect(effects, &EffectsHandler::virtualScreenGeometryChanged, this, [this]() {
+        m_blurStylesTimer.start(0);
+    });
+    connect(effects, &EffectsHandler::windowClosed, this, &BlurEffect::invalidateCoveredOutputs);
+    connect(effects, &EffectsHandler::screenLockingChanged, this, &BlurEffect::invalidateCoveredOutputs);
 
     // Fetch the blur regions for all windows
+    requestX11BlurRegions();
     const auto stackingOrder = effects->stackingOrder();
     for (EffectWindow *window : stackingOrder) {
         slotWindowAdded(window);
@@ -229,45 +286,173 @@ void BlurEffect::initBlurStrengthValues()
     }
 }
 
+/**
+ * @return The distance in device pixels between a pixel of the source texture and the farthest sample that the dual
+ * Kawase filter takes for it.
+ */
+static float samplingRadius(size_t iterationCount, float offset)
+{
+    float radius = 0;
+    for (size_t i = 1; i <= iterationCount; ++i) {
+        const float texelSize = 1 << (i - 1);
+        // The downsample pass reads level i - 1 at half a texel times the offset, the upsample pass reads level i
+        // (twice as large texels) at one texel times the offset. Linear filtering reaches one texel further.
+        radius += (0.5 * offset + 1) * texelSize;
+        radius += (offset + 1) * texelSize * 2;
+    }
+    return radius;
+}
+
+void BlurEffect::blurStrength(const BlurRule &policy, size_t &iterationCount, float &offset) const
+{
+    iterationCount = m_iterationCount;
+    offset = m_offset;
+    if (policy.maxIterations.has_value() && static_cast<size_t>(*policy.maxIterations) < iterationCount) {
+        iterationCount = *policy.maxIterations;
+        offset = blurOffsets[iterationCount - 1].maxOffset;
+    }
+}
+
+int BlurEffect::expandSize(const BlurRule &policy, qreal scale) const
+{
+    size_t iterationCount;
+    float offset;
+    blurStrength(policy, iterationCount, offset);
+
+    // The expand sizes in blurOffsets were determined for the maximum offset of each iteration, the footprint at
+    // lower offsets shrinks proportionally. The blur is done in device pixels, the expand size is in logical pixels.
+    const OffsetStruct &offsets = blurOffsets[iterationCount - 1];
+    const float footprint = offsets.expandSize * samplingRadius(iterationCount, offset) / samplingRadius(iterationCount, offsets.maxOffset);
+    return std::ceil(footprint / scale);
+}
+
+/**
+ * Expands every rect of the region to a grid with the specified cell size, so that nearby rects get merged.
+ */
+static QRegion simplifyRegion(const QRegion &region, int tolerance)
+{
+    if (tolerance <= 1) {
+        return region;
+    }
+
+    const auto floorToGrid = [tolerance](int value) {
+        return static_cast<int>(std::floor(static_cast<double>(value) / tolerance)) * tolerance;
+    };
+    const auto ceilToGrid = [tolerance](int value) {
+        return static_cast<int>(std::ceil(static_cast<double>(value) / tolerance)) * tolerance;
+    };
+
+    QRegion simplified;
+    for (const QRect &rect : region) {
+        simplified += QRect(QPoint(floorToGrid(rect.x()), floorToGrid(rect.y())),
+                            QPoint(ceilToGrid(rect.x() + rect.width()) - 1, ceilToGrid(rect.y() + rect.height()) - 1));
+    }
+    return simplified & region.boundingRect();
+}
+
 void BlurEffect::reconfigure(ReconfigureFlags flags)
 {
+    // The settings are diffed with the previous ones, so that applying a change in the KCM doesn't throw away caches
+    // that are still valid.
+    const BlurSettings previous = m_settings;
+    const bool initial = !m_settingsRead;
     m_settings.read();
+    m_settingsRead = true;
 
-    m_iterationCount = blurStrengthValues[m_settings.general.blurStrength].iteration;
-    m_offset = blurStrengthValues[m_settings.general.blurStrength].offset;
-    m_expandSize = blurOffsets[m_iterationCount - 1].expandSize;
-    m_staticBlurTextures.clear();
-    m_colorMatrix = colorMatrix(m_settings.general.brightness, m_settings.general.saturation, m_settings.general.contrast);
+    const GeneralSettings &general = m_settings.general;
+    const bool strengthChanged = initial || general.blurStrength != previous.general.blurStrength;
+    const bool colorChanged = initial
+        || general.brightness != previous.general.brightness
+        || general.saturation != previous.general.saturation
+        || general.contrast != previous.general.contrast;
+    const bool noiseChanged = general.noiseStrength != previous.general.noiseStrength;
+    const bool forceBlurChanged = initial || m_settings.forceBlur != previous.forceBlur || m_settings.rules != previous.rules;
+    const bool roundedCornersChanged = m_settings.roundedCorners != previous.roundedCorners;
 
-    for (EffectWindow *w : effects->stackingOrder()) {
-        updateBlurRegion(w);
+    if (strengthChanged) {
+        m_iterationCount = blurStrengthValues[general.blurStrength].iteration;
+        m_offset = blurStrengthValues[general.blurStrength].offset;
+    }
+    if (colorChanged) {
+        m_colorMatrix = colorMatrix(general.brightness, general.saturation, general.contrast);
     }
 
-    // Update all windows for the blur to take effect
-    effects->addRepaintFull();
+    // The static blur textures contain the blurred image with the color matrix and noise already applied.
+    if (strengthChanged || colorChanged || noiseChanged || m_settings.staticBlur != previous.staticBlur) {
+        effects->makeOpenGLContextCurrent();
+        m_staticBlurTextures.clear();
+        m_staticBlurBuilds.clear();
+        m_staticBlurCache.clear();
+        m_staticBlurDiskCacheMisses.clear();
+        if (!staticBlurInUse() || m_settings.staticBlur.imageSource != StaticBlurImageSource::Custom) {
+            m_customImageLoader.clear();
+        }
+    }
+    m_staticBlurCache.setBudget(static_cast<qint64>(m_settings.staticBlur.cacheSize) * 1024 * 1024);
+
+    if (initial) {
+        effects->addRepaintFull();
+        return;
+    }
+    if (m_settings == previous) {
+        return;
+    }
+
+    // Windows that stop being blurred need to be repainted as well, so their old blur area is damaged too.
+    QRegion damage;
+    const auto damageBlurredWindows = [this, &damage]() {
+        for (auto index = 0u; index < m_windows.slotCount(); ++index) {
+            if (m_windows.testFlag(index, HasBlur)) {
+                EffectWindow *w = m_windows.window(index);
+                damage += blurRegion(w).translated(w->pos().toPoint());
+            }
+        }
+    };
+
+    damageBlurredWindows();
+    if (forceBlurChanged) {
+        if (m_settings.forceBlur.windowClasses != previous.forceBlur.windowClasses
+            || m_settings.forceBlur.windowClassMatchingMode != previous.forceBlur.windowClassMatchingMode) {
+            m_windows.clearFlag(WindowClassMatchCached);
+        }
+        for (EffectWindow *w : effects->stackingOrder()) {
+            updateBlurRegion(w);
+        }
+        damageBlurredWindows();
+    } else if (roundedCornersChanged) {
+        updateBlurStyles();
+    }
+
+    if (m_settings.staticBlur.disableWhenWindowBehind != previous.staticBlur.disableWhenWindowBehind) {
+        m_windowBehindDirty = true;
+    }
+
+    // Repaint the blurred windows for the changes to take effect. The opaque windows above them are repainted by
+    // prePaintWindow where needed.
+    if (!damage.isEmpty()) {
+        effects->addRepaint(damage);
+    }
 }
 
 void BlurEffect::updateBlurRegion(EffectWindow *w, bool geometryChanged)
 {
+    // Rules only depend on the window class and type, which don't change along with the geometry.
+    BlurRule policy;
+    if (const BlurEffectData *data = blurData(w); geometryChanged && data) {
+        policy = data->policy;
+    } else {
+        policy = resolveBlurRule(w);
+    }
+    if (policy.mode == BlurMode::Off) {
+        removeBlurData(w);
+        return;
+    }
+
     std::optional<QRegion> content;
     std::optional<QRegion> frame;
 
     if (net_wm_blur_region != XCB_ATOM_NONE) {
-        const QByteArray value = w->readProperty(net_wm_blur_region, XCB_ATOM_CARDINAL, 32);
-        QRegion region;
-        if (value.size() > 0 && !(value.size() % (4 * sizeof(uint32_t)))) {
-            const uint32_t *cardinals = reinterpret_cast<const uint32_t *>(value.constData());
-            for (unsigned int i = 0; i < value.size() / sizeof(uint32_t);) {
-                int x = cardinals[i++];
-                int y = cardinals[i++];
-                int w = cardinals[i++];
-                int h = cardinals[i++];
-                region += Xcb::fromXNative(QRect(x, y, w, h)).toRect();
-            }
-        }
-        if (!value.isNull()) {
-            content = region;
-        }
+        content = x11BlurRegion(w);
     }
 
     SurfaceInterface *surf = w->surface();
@@ -302,56 +487,368 @@ void BlurEffect::updateBlurRegion(EffectWindow *w, bool geometryChanged)
     }
 
     if (content.has_value() || frame.has_value()) {
-        BlurEffectData &data = m_windows[w];
+        const auto index = m_windows.insert(w);
+        std::optional<BlurEffectData> &blurInfo = m_windows.record(index).blur;
+        const bool created = !blurInfo;
+        if (created) {
+            blurInfo.emplace();
+            blurInfo->windowEffect = ItemEffect(w->windowItem());
+            m_windows.setFlag(index, HasBlur);
+            m_windowBehindDirty = true;
+            invalidateCoveredOutputs();
+        }
+        BlurEffectData &data = *blurInfo;
         data.content = content;
         data.frame = frame;
-        data.windowEffect = ItemEffect(w->windowItem());
+        data.policy = policy;
+
+        // Moving a window or resizing it without changing the blur region is common, skip the rest in that case.
+        const QRegion region = effectiveBlurRegion(w, data);
+        if (created || !geometryChanged || region != data.region) {
+            data.region = region;
+            updateBlurStyle(w, data);
+        }
     } else if (!geometryChanged) { // Blur may disappear if this method is called when window geometry changes
-        if (auto it = m_windows.find(w); it != m_windows.end()) {
-            effects->makeOpenGLContextCurrent();
-            m_windows.erase(it);
+        removeBlurData(w);
+    }
+}
+
+static std::optional<QRegion> parseX11BlurRegion(const QByteArray &value)
+{
+    if (value.isNull()) {
+        return std::nullopt;
+    }
+
+    QRegion region;
+    if (value.size() > 0 && !(value.size() % (4 * sizeof(uint32_t)))) {
+        const uint32_t *cardinals = reinterpret_cast<const uint32_t *>(value.constData());
+        for (unsigned int i = 0; i < value.size() / sizeof(uint32_t);) {
+            int x = cardinals[i++];
+            int y = cardinals[i++];
+            int w = cardinals[i++];
+            int h = cardinals[i++];
+            region += Xcb::fromXNative(QRect(x, y, w, h)).toRect();
         }
     }
+    return region;
+}
+
+std::optional<QRegion> BlurEffect::x11BlurRegion(EffectWindow *w)
+{
+    WindowState &state = m_windows.record(m_windows.insert(w));
+    if (state.x11BlurRegionState == X11BlurRegionState::Unknown) {
+        readX11BlurRegion(w);
+    }
+    return state.x11BlurRegion;
+}
+
+void BlurEffect::readX11BlurRegion(EffectWindow *w)
+{
+    WindowState &state = m_windows.record(m_windows.insert(w));
+    state.x11BlurRegion = parseX11BlurRegion(w->readProperty(net_wm_blur_region, XCB_ATOM_CARDINAL, 32));
+    state.x11BlurRegionState = X11BlurRegionState::Cached;
+}
+
+void BlurEffect::requestX11BlurRegions()
+{
+    if (net_wm_blur_region == XCB_ATOM_NONE) {
+        return;
+    }
+
+    for (EffectWindow *w : effects->stackingOrder()) {
+        const auto x11Window = qobject_cast<X11Window *>(w->window());
+        if (!x11Window) {
+            continue;
+        }
+
+        m_windows.record(m_windows.insert(w)).x11BlurRegionState = X11BlurRegionState::Pending;
+        m_pendingX11BlurRegions.emplace_back(w, std::make_unique<Xcb::Property>(false, x11Window->window(), net_wm_blur_region, XCB_ATOM_ANY, 0, 32768));
+    }
+
+    if (!m_pendingX11BlurRegions.empty()) {
+        QTimer::singleShot(0, this, &BlurEffect::collectX11BlurRegions);
+    }
+}
+
+void BlurEffect::collectX11BlurRegions()
+{
+    const auto pending = std::exchange(m_pendingX11BlurRegions, {});
+    for (const auto &[w, property] : pending) {
+        const auto index = m_windows.find(w);
+        if (index == m_windows.InvalidIndex || m_windows.record(index).x11BlurRegionState != X11BlurRegionState::Pending) {
+            continue;
+        }
+
+        WindowState &state = m_windows.record(index);
+        if (property->isNull()) {
+            state.x11BlurRegion = std::nullopt;
+            state.x11BlurRegionState = X11BlurRegionState::Cached;
+        } else if (property->data()->bytes_after > 0) {
+            // The region doesn't fit in the reply, read the whole property.
+            readX11BlurRegion(w);
+        } else {
+            state.x11BlurRegion = parseX11BlurRegion(property->toByteArray(32, XCB_ATOM_CARDINAL));
+            state.x11BlurRegionState = X11BlurRegionState::Cached;
+        }
+        updateBlurRegion(w);
+    }
+}
+
+void BlurEffect::scheduleBlurRegionUpdate(EffectWindow *w, bool geometryChanged)
+{
+    const auto index = m_windows.find(w);
+    if (index == m_windows.InvalidIndex) {
+        updateBlurRegion(w, geometryChanged);
+        return;
+    }
+
+    // A full update includes a geometry update.
+    if (!m_windows.testFlag(index, BlurRegionDirty)) {
+        m_windows.setFlag(index, BlurRegionDirty);
+        m_windows.setFlag(index, BlurRegionGeometryChanged, geometryChanged);
+    } else if (!geometryChanged) {
+        m_windows.setFlag(index, BlurRegionGeometryChanged, false);
+    }
+    m_blurRegionUpdatesPending = true;
+    if (!m_active) {
+        scheduleActiveStateUpdate();
+    }
+}
+
+void BlurEffect::updateScheduledBlurRegions()
+{
+    m_blurRegionUpdatesPending = false;
+    for (auto index = 0u; index < m_windows.slotCount(); ++index) {
+        if (!m_windows.testFlag(index, BlurRegionDirty)) {
+            continue;
+        }
+
+        const bool geometryChanged = m_windows.testFlag(index, BlurRegionGeometryChanged);
+        m_windows.setFlag(index, BlurRegionDirty | BlurRegionGeometryChanged, false);
+        updateBlurRegion(m_windows.window(index), geometryChanged);
+    }
+}
+
+BlurEffectData *BlurEffect::blurData(const EffectWindow *w)
+{
+    const auto index = m_windows.find(w);
+    if (index == m_windows.InvalidIndex || !m_windows.testFlag(index, HasBlur)) {
+        return nullptr;
+    }
+    return &*m_windows.record(index).blur;
+}
+
+const BlurEffectData *BlurEffect::blurData(const EffectWindow *w) const
+{
+    const auto index = m_windows.find(w);
+    if (index == m_windows.InvalidIndex || !m_windows.testFlag(index, HasBlur)) {
+        return nullptr;
+    }
+    return &*m_windows.record(index).blur;
+}
+
+void BlurEffect::removeBlurData(const EffectWindow *w)
+{
+    const auto index = m_windows.find(w);
+    if (index == m_windows.InvalidIndex || !m_windows.testFlag(index, HasBlur)) {
+        return;
+    }
+    effects->makeOpenGLContextCurrent();
+    m_windows.record(index).blur.reset();
+    m_windows.setFlag(index, HasBlur, false);
+    invalidateCoveredOutputs();
+}
+
+void BlurEffect::updateBlurStyle(EffectWindow *w)
+{
+    if (BlurEffectData *data = blurData(w)) {
+        updateBlurStyle(w, *data);
+    }
+}
+
+void BlurEffect::updateBlurStyles()
+{
+    for (auto index = 0u; index < m_windows.slotCount(); ++index) {
+        if (m_windows.testFlag(index, HasBlur)) {
+            updateBlurStyle(m_windows.window(index), *m_windows.record(index).blur);
+        }
+    }
+}
+
+void BlurEffect::updateBlurStyle(EffectWindow *w, BlurEffectData &data) const
+{
+    const QRegion region = blurRegion(w);
+    BlurStyle &style = data.style;
+    style.dockFloating = w->isDock() && isDockFloating(w, region);
+    style.maximized = effects->clientArea(MaximizeArea, w->screen(), effects->currentDesktop()) == w->frameGeometry();
+    style.topCornerRadius = 0;
+    style.bottomCornerRadius = 0;
+    style.opaqueCornerCutouts = QRegion();
+
+    if (w->isDock() && !style.dockFloating) {
+        return;
+    }
+
+    if (isMenu(w)) {
+        style.topCornerRadius = style.bottomCornerRadius = m_settings.roundedCorners.menuRadius;
+    } else if (w->isDock()) {
+        style.topCornerRadius = style.bottomCornerRadius = m_settings.roundedCorners.dockRadius;
+    } else if ((!w->isFullScreen() && !style.maximized) || m_settings.roundedCorners.roundMaximized) {
+        if (!w->decoration() || (w->decoration() && m_settings.forceBlur.blurDecorations)) {
+            style.topCornerRadius = m_settings.roundedCorners.windowTopRadius;
+        }
+        style.bottomCornerRadius = m_settings.roundedCorners.windowBottomRadius;
+    }
+
+    // Static blur marks the blur region as opaque, except for the corners, which are cut out regardless of whether
+    // the window is maximized.
+    int topCornerRadius;
+    int bottomCornerRadius;
+    if (isMenu(w)) {
+        topCornerRadius = bottomCornerRadius = std::ceil(m_settings.roundedCorners.menuRadius);
+    } else if (w->isDock()) {
+        topCornerRadius = bottomCornerRadius = std::ceil(m_settings.roundedCorners.dockRadius);
+    } else {
+        topCornerRadius = std::ceil(m_settings.roundedCorners.windowTopRadius);
+        bottomCornerRadius = std::ceil(m_settings.roundedCorners.windowBottomRadius);
+    }
+
+    const QRect blurRect = region.boundingRect();
+    style.opaqueCornerCutouts += QRect(blurRect.x(), blurRect.y(), topCornerRadius, topCornerRadius);
+    style.opaqueCornerCutouts += QRect(blurRect.x() + blurRect.width() - topCornerRadius, blurRect.y(), topCornerRadius, topCornerRadius);
+    style.opaqueCornerCutouts += QRect(blurRect.x(), blurRect.y() + blurRect.height() - bottomCornerRadius, bottomCornerRadius, bottomCornerRadius);
+    style.opaqueCornerCutouts += QRect(blurRect.x() + blurRect.width() - bottomCornerRadius, blurRect.y() + blurRect.height() - bottomCornerRadius, bottomCornerRadius, bottomCornerRadius);
 }
 
 bool BlurEffect::hasStaticBlur(EffectWindow *w)
 {
-    if (!m_settings.staticBlur.enable) {
+    const auto index = m_windows.find(w);
+    const BlurEffectData *data = blurData(w);
+    if (data && data->policy.mode.has_value()) {
+        if (data->policy.mode != BlurMode::Static) {
+            return false;
+        }
+    } else if (!m_settings.staticBlur.enable) {
         return false;
     }
 
-    if (m_settings.staticBlur.disableWhenWindowBehind) {
-        if (auto it = m_windows.find(w); it != m_windows.end()) {
-            return !it->second.hasWindowBehind;
-        }
+    // Only the parts of the window that are in front of other windows are blurred dynamically, unless that's all of it.
+    if (m_settings.staticBlur.disableWhenWindowBehind && data && m_windows.testFlag(index, HasWindowBehind)) {
+        return !(data->region.translated(w->pos().toPoint()) - data->windowBehind).isEmpty();
     }
 
     return true;
 }
 
+QRegion BlurEffect::dynamicBlurArea(EffectWindow *w, const QRegion &blurArea) const
+{
+    const auto index = m_windows.find(w);
+    const BlurEffectData *data = blurData(w);
+    if (!m_settings.staticBlur.disableWhenWindowBehind || !data || !m_windows.testFlag(index, HasWindowBehind)) {
+        return QRegion();
+    }
+
+    const QRegion area = blurArea & data->windowBehind;
+    if (area.isEmpty()) {
+        return QRegion();
+    }
+
+    const int expand = expandSize(data->policy, m_currentScreen ? m_currentScreen->scale() : 1.0);
+    QRegion expanded;
+    for (const QRect &rect : area) {
+        expanded += rect.adjusted(-expand, -expand, expand, expand);
+    }
+    return expanded & blurArea;
+}
+
+bool BlurEffect::staticBlurInUse() const
+{
+    return m_settings.staticBlur.enable || m_settings.rules.anyStatic;
+}
+
+bool BlurEffect::canBeBehindBlurredWindow(const EffectWindow *w) const
+{
+    return !w->isDesktop()
+        && w->isOnCurrentDesktop()
+        && w->isOnCurrentActivity()
+        && w->window()->resourceClass() != "xwaylandvideobridge"
+        && !w->isMinimized();
+}
+
+void BlurEffect::updateWindowGrid(EffectWindow *w)
+{
+    if (canBeBehindBlurredWindow(w)) {
+        m_windowGrid.update(w, w->frameGeometry().toRect());
+    } else {
+        m_windowGrid.remove(w);
+    }
+    m_windowBehindDirty = true;
+    invalidateCoveredOutputs();
+}
+
+void BlurEffect::rebuildWindowGrid()
+{
+    m_windowGrid.clear();
+    for (EffectWindow *w : effects->stackingOrder()) {
+        updateWindowGrid(w);
+    }
+}
+
+void BlurEffect::updateHasWindowBehind()
+{
+    m_windowBehindDirty = false;
+    for (auto index = 0u; index < m_windows.slotCount(); ++index) {
+        if (!m_windows.testFlag(index, HasBlur)) {
+            continue;
+        }
+
+        EffectWindow *w = m_windows.window(index);
+        const QRect frameGeometry = w->frameGeometry().toRect();
+        QRegion windowBehind;
+        for (EffectWindow *other : m_windowGrid.query(frameGeometry)) {
+            if (other != w && other->window()->stackingOrder() < w->window()->stackingOrder()) {
+                windowBehind += other->frameGeometry().toRect() & frameGeometry;
+            }
+        }
+        m_windows.setFlag(index, HasWindowBehind, !windowBehind.isEmpty());
+        m_windows.record(index).blur->windowBehind = windowBehind;
+    }
+}
+
 void BlurEffect::slotWindowAdded(EffectWindow *w)
 {
+    WindowState &state = m_windows.record(m_windows.insert(w));
     SurfaceInterface *surf = w->surface();
 
     if (surf) {
-        windowBlurChangedConnections[w] = connect(surf, &SurfaceInterface::blurChanged, this, [this, w]() {
+        state.blurChangedConnection = connect(surf, &SurfaceInterface::blurChanged, this, [this, w]() {
             if (w) {
-                updateBlurRegion(w);
+                scheduleBlurRegionUpdate(w);
             }
         });
     }
 
-    windowFrameGeometryChangedConnections[w] = connect(w, &EffectWindow::windowFrameGeometryChanged, this, [this,w]() {
+    state.frameGeometryChangedConnection = connect(w, &EffectWindow::windowFrameGeometryChanged, this, [this,w](EffectWindow *, const QRectF &oldGeometry) {
         if (!w) {
             return;
         }
 
+        updateWindowGrid(w);
+
+        // The blur region is relative to the window, so moving it doesn't update the style. Whether the window is
+        // maximized or a floating dock depends on its position though, and panels change the work area.
+        if (w->isDock()) {
+            m_blurStylesTimer.start(0);
+        } else if (w->frameGeometry().topLeft() != oldGeometry.topLeft()) {
+            updateBlurStyle(w);
+        }
+
         if (w->isDesktop() && !effects->waylandDisplay()) {
             m_staticBlurTextures.erase(nullptr);
             return;
         }
 
-        updateBlurRegion(w, true);
+        scheduleBlurRegionUpdate(w, true);
     });
 
     if (auto internal = w->internalWindow()) {
@@ -360,56 +857,107 @@ void BlurEffect::slotWindowAdded(EffectWindow *w)
 
     connect(w, &EffectWindow::windowDecorationChanged, this, &BlurEffect::setupDecorationConnections);
     setupDecorationConnections(w);
+    if (w->isDock()) {
+        m_blurStylesTimer.start(0);
+    }
 
-    updateBlurRegion(w);
+    const auto windowClassChanged = [this, w]() {
+        if (const auto index = m_windows.find(w); index != m_windows.InvalidIndex) {
+            m_windows.setFlag(index, WindowClassMatchCached, false);
+        }
+        scheduleBlurRegionUpdate(w);
+    };
+    connect(w->window(), &Window::windowClassChanged, this, windowClassChanged);
+    connect(w->window(), &Window::windowRoleChanged, this, windowClassChanged);
+
+    const auto updateBlurStyle = [this, w]() {
+        BlurEffect::updateBlurStyle(w);
+    };
+    connect(w, &EffectWindow::windowMaximizedStateChanged, this, updateBlurStyle);
+    connect(w, &EffectWindow::windowFullScreenChanged, this, updateBlurStyle);
+    connect(w, &EffectWindow::windowFullScreenChanged, this, &BlurEffect::invalidateCoveredOutputs);
+    connect(w, &EffectWindow::windowOpacityChanged, this, &BlurEffect::invalidateCoveredOutputs);
+    connect(w, &EffectWindow::windowDecorationChanged, this, [this, w]() {
+        scheduleBlurRegionUpdate(w);
+    });
+    connect(w, &EffectWindow::windowMinimized, this, &BlurEffect::updateWindowGrid);
+    connect(w, &EffectWindow::windowUnminimized, this, &BlurEffect::updateWindowGrid);
+    connect(w, &EffectWindow::windowDesktopsChanged, this, &BlurEffect::updateWindowGrid);
+    connect(w->window(), &Window::activitiesChanged, this, [this, w]() {
+        updateWindowGrid(w);
+    });
+    if (w->isDesktop()) {
+        connect(w, &EffectWindow::windowDamaged, this, [this, w]() {
+            m_damagedDesktops.insert(w);
+        });
+    }
 
-    m_allWindows.push_back(w);
+    updateBlurRegion(w);
+    updateWindowGrid(w);
 }
 
 void BlurEffect::slotWindowDeleted(EffectWindow *w)
 {
-    if (auto it = m_windows.find(w); it != m_windows.end()) {
-        effects->makeOpenGLContextCurrent();
-        m_windows.erase(it);
-    }
-    if (auto it = windowBlurChangedConnections.find(w); it != windowBlurChangedConnections.end()) {
-        disconnect(*it);
-        windowBlurChangedConnections.erase(it);
-    }
-    if (auto it = windowFrameGeometryChangedConnections.find(w); it != windowFrameGeometryChangedConnections.end()) {
-        disconnect(*it);
-        windowFrameGeometryChangedConnections.erase(it);
-    }
-    if (auto it = std::find(m_allWindows.begin(), m_allWindows.end(), w); it != m_allWindows.end()) {
-        m_allWindows.erase(it);
+    if (const auto index = m_windows.find(w); index != m_windows.InvalidIndex) {
+        WindowState &state = m_windows.record(index);
+        disconnect(state.blurChangedConnection);
+        disconnect(state.frameGeometryChangedConnection);
+        if (state.blur) {
+            effects->makeOpenGLContextCurrent();
+        }
+        m_windows.remove(w);
     }
-
-    if (m_blurWhenTransformed.contains(w)) {
-        m_blurWhenTransformed.removeOne(w);
+    m_windowGrid.remove(w);
+    m_damagedDesktops.erase(w);
+    m_windowBehindDirty = true;
+    invalidateCoveredOutputs();
+    if (w->isDock()) {
+        m_blurStylesTimer.start(0);
     }
 }
 
 void BlurEffect::slotScreenAdded(KWin::Output *screen)
 {
+    invalidateCoveredOutputs();
+    m_blurStylesTimer.start(0);
     screenChangedConnections[screen] = connect(screen, &Output::changed, this, [this, screen]() {
-        if (!m_settings.staticBlur.enable) {
+        invalidateCoveredOutputs();
+        m_blurStylesTimer.start(0);
+        if (!staticBlurInUse()) {
             return;
         }
 
-        m_staticBlurTextures.erase(screen);
+        if (m_staticBlurTextures.contains(screen) || m_staticBlurBuilds.contains(screen)) {
+            effects->makeOpenGLContextCurrent();
+            m_staticBlurTextures.erase(screen);
+            m_staticBlurBuilds.erase(screen);
+        }
         effects->addRepaintFull();
     });
 }
 
 void BlurEffect::slotScreenRemoved(KWin::Output *screen)
 {
-    for (auto &[window, data] : m_windows) {
+    invalidateCoveredOutputs();
+    m_blurStylesTimer.start(0);
+
+    for (auto index = 0u; index < m_windows.slotCount(); ++index) {
+        if (!m_windows.testFlag(index, HasBlur)) {
+            continue;
+        }
+
+        BlurEffectData &data = *m_windows.record(index).blur;
         if (auto it = data.render.find(screen); it != data.render.end()) {
             effects->makeOpenGLContextCurrent();
             data.render.erase(it);
         }
     }
 
+    if (m_staticBlurBuilds.contains(screen)) {
+        effects->makeOpenGLContextCurrent();
+        m_staticBlurBuilds.erase(screen);
+    }
+
     if (auto it = screenChangedConnections.find(screen); it != screenChangedConnections.end()) {
         disconnect(*it);
         screenChangedConnections.erase(it);
@@ -419,7 +967,8 @@ void BlurEffect::slotScreenRemoved(KWin::Output *screen)
 void BlurEffect::slotPropertyNotify(EffectWindow *w, long atom)
 {
     if (w && atom == net_wm_blur_region && net_wm_blur_region != XCB_ATOM_NONE) {
-        updateBlurRegion(w);
+        readX11BlurRegion(w);
+        scheduleBlurRegionUpdate(w);
     }
 }
 
@@ -430,7 +979,7 @@ void BlurEffect::setupDecorationConnections(EffectWindow *w)
     }
 
     connect(w->decoration(), &KDecoration3::Decoration::blurRegionChanged, this, [this, w]() {
-        updateBlurRegion(w);
+        scheduleBlurRegionUpdate(w);
     });
 }
 
@@ -441,7 +990,7 @@ bool BlurEffect::eventFilter(QObject *watched, QEvent *event)
         QDynamicPropertyChangeEvent *pe = static_cast<QDynamicPropertyChangeEvent *>(event);
         if (pe->propertyName() == "kwin_blur") {
             if (auto w = effects->findWindow(internal)) {
-                updateBlurRegion(w);
+                scheduleBlurRegionUpdate(w);
             }
         }
     }
@@ -476,26 +1025,32 @@ QRegion BlurEffect::decorationBlurRegion(const EffectWindow *w) const
 }
 
 QRegion BlurEffect::blurRegion(EffectWindow *w) const
+{
+    if (const BlurEffectData *data = blurData(w)) {
+        return data->region;
+    }
+    return QRegion();
+}
+
+QRegion BlurEffect::effectiveBlurRegion(EffectWindow *w, const BlurEffectData &data) const
 {
     QRegion region;
 
-    if (auto it = m_windows.find(w); it != m_windows.end()) {
-        const std::optional<QRegion> &content = it->second.content;
-        const std::optional<QRegion> &frame = it->second.frame;
-        if (content.has_value()) {
-            if (content->isEmpty()) {
-                // An empty region means that the blur effect should be enabled
-                // for the whole window.
-                region = w->rect().toRect();
-            } else {
-                if (frame.has_value()) {
-                    region = frame.value();
-                }
-                region += content->translated(w->contentsRect().topLeft().toPoint()) & w->contentsRect().toRect();
+    const std::optional<QRegion> &content = data.content;
+    const std::optional<QRegion> &frame = data.frame;
+    if (content.has_value()) {
+        if (content->isEmpty()) {
+            // An empty region means that the blur effect should be enabled
+            // for the whole window.
+            region = w->rect().toRect();
+        } else {
+            if (frame.has_value()) {
+                region = frame.value();
             }
-        } else if (frame.has_value()) {
-            region = frame.value();
+            region += content->translated(w->contentsRect().topLeft().toPoint()) & w->contentsRect().toRect();
         }
+    } else if (frame.has_value()) {
+        region = frame.value();
     }
 
     return region;
@@ -503,207 +1058,689 @@ QRegion BlurEffect::blurRegion(EffectWindow *w) const
 
 void BlurEffect::prePaintScreen(ScreenPrePaintData &data, std::chrono::milliseconds presentTime)
 {
+    m_currentScreen = effects->waylandDisplay() ? data.screen : nullptr;
+#ifdef BETTERBLUR_TILE_DAMAGE
+    const QRect bounds = m_currentScreen ? m_currentScreen->geometry() : effects->virtualScreenGeometry();
+    m_paintedArea.reset(bounds);
+    m_currentBlur.reset(bounds);
+#else
     m_paintedArea = QRegion();
     m_currentBlur = QRegion();
-    m_currentScreen = effects->waylandDisplay() ? data.screen : nullptr;
+#endif
+    m_currentBlurExpandSize = 0;
+    m_presentTime = presentTime;
+    m_paintedWindows.clear();
+    m_paintedBlurredWindowCount = 0;
+    m_staticBlurNeeded = false;
+    m_visibleBlurRegionsDirty = true;
+    m_desktopCapture.reset();
+
+    if (m_blurRegionUpdatesPending) {
+        updateScheduledBlurRegions();
+    }
+    if (!m_pendingDiskCacheStores.empty()) {
+        storeStaticBlurTextures();
+    }
+
+    // The effect may have become active again since the last frame.
+    updateActiveState();
+
+    // Nothing needs to be done for outputs without visible blurred windows, for example when a fullscreen game or
+    // video covers them.
+    m_skipScreen = !hasVisibleBlur(data.screen);
+    if (m_skipScreen) {
+        effects->prePaintScreen(data, presentTime);
+        return;
+    }
+
+    if (m_windowBehindDirty && staticBlurInUse() && m_settings.staticBlur.disableWhenWindowBehind) {
+        updateHasWindowBehind();
+    }
 
     effects->prePaintScreen(data, presentTime);
 }
 
+void BlurEffect::postPaintScreen()
+{
+    if (m_coveredOutputsAnimated) {
+        invalidateCoveredOutputs();
+    }
+    effects->postPaintScreen();
+}
+
 void BlurEffect::prePaintWindow(EffectWindow *w, WindowPrePaintData &data, std::chrono::milliseconds presentTime)
 {
+    if (m_skipScreen) {
+        effects->prePaintWindow(w, data, presentTime);
+        return;
+    }
+
     // this effect relies on prePaintWindow being called in the bottom to top order
 
     // in case this window has regions to be blurred
     const QRegion blurArea = blurRegion(w).translated(w->pos().toPoint());
-
-    bool staticBlur = hasStaticBlur(w) && m_staticBlurTextures.contains(m_currentScreen) && !blurArea.isEmpty();
+    // The opaque region of the window itself, before it's modified by this and other effects
+    const QRegion windowOpaque = data.opaque;
+
+    const bool usesStaticBlur = !blurArea.isEmpty() && hasStaticBlur(w)
+        && (!m_currentScreen || blurArea.intersects(m_currentScreen->geometry()));
+    m_staticBlurNeeded |= usesStaticBlur;
+    bool staticBlur = usesStaticBlur && m_staticBlurTextures.contains(m_currentScreen);
+    QRegion dynamicArea;
     if (staticBlur) {
+        // The parts in front of other windows are blurred dynamically, so the windows behind them must be painted.
+        dynamicArea = dynamicBlurArea(w, blurArea);
         if (!m_settings.general.windowOpacityAffectsBlur) {
-            data.opaque += blurArea;
-        }
-
-        int topCornerRadius;
-        int bottomCornerRadius;
-        if (isMenu(w)) {
-            topCornerRadius = bottomCornerRadius = std::ceil(m_settings.roundedCorners.menuRadius);
-        } else if (w->isDock()) {
-            topCornerRadius = bottomCornerRadius = std::ceil(m_settings.roundedCorners.dockRadius);
-        } else {
-            topCornerRadius = std::ceil(m_settings.roundedCorners.windowTopRadius);
-            bottomCornerRadius = std::ceil(m_settings.roundedCorners.windowBottomRadius);
+            data.opaque += blurArea - dynamicArea;
         }
 
-        if (!w->isDock() || (w->isDock() && isDockFloating(w, blurArea))) {
-            const QRect blurRect = blurArea.boundingRect();
-            data.opaque -= QRect(blurRect.x(), blurRect.y(), topCornerRadius, topCornerRadius);
-            data.opaque -= QRect(blurRect.x() + blurRect.width() - topCornerRadius, blurRect.y(), topCornerRadius, topCornerRadius);
-            data.opaque -= QRect(blurRect.x(), blurRect.y() + blurRect.height() - bottomCornerRadius, bottomCornerRadius, bottomCornerRadius);
-            data.opaque -= QRect(blurRect.x() + blurRect.width() - bottomCornerRadius, blurRect.y() + blurRect.height() - bottomCornerRadius, bottomCornerRadius, bottomCornerRadius);
+        const BlurStyle &style = blurData(w)->style;
+        if (!w->isDock() || style.dockFloating) {
+            data.opaque -= style.opaqueCornerCutouts.translated(w->pos().toPoint());
             data.mask |= Effect::PAINT_WINDOW_TRANSLUCENT;
         }
+
+        // The blurred image changed around the damaged parts of the desktop.
+        data.paint += blurArea & m_staticBlurTextures[m_currentScreen].damage;
     }
 
-    if (m_settings.staticBlur.enable) {
+    if (staticBlurInUse()) {
         if (m_settings.staticBlur.disableWhenWindowBehind) {
-            if (auto it = m_windows.find(w); it != m_windows.end()) {
-                const bool hadWindowBehind = it->second.hasWindowBehind;
-                it->second.hasWindowBehind = false;
-                for (EffectWindow *other : m_allWindows) {
-                    if (w->window()->stackingOrder() <= other->window()->stackingOrder()
-                        || other->isDesktop()
-                        || !other->isOnCurrentDesktop()
-                        || !other->isOnCurrentActivity()
-                        || other->window()->resourceClass() == "xwaylandvideobridge"
-                        || other->isMinimized()) {
-                        continue;
-                    }
-
-                    if (w->frameGeometry().intersects(other->frameGeometry())) {
-                        it->second.hasWindowBehind = true;
-                        break;
-                    }
-                }
-
-                if (hadWindowBehind != it->second.hasWindowBehind) {
+            if (const auto index = m_windows.find(w); index != m_windows.InvalidIndex && m_windows.testFlag(index, HasBlur)) {
+                const bool hasWindowBehind = m_windows.testFlag(index, HasWindowBehind);
+                if (m_windows.testFlag(index, PaintedWindowBehind) != hasWindowBehind) {
+                    m_windows.setFlag(index, PaintedWindowBehind, hasWindowBehind);
                     data.paint += blurArea;
                     data.opaque -= blurArea;
                 }
             }
         }
 
-        if (m_settings.staticBlur.imageSource == StaticBlurImageSource::DesktopWallpaper && w->isDesktop() && w->frameGeometry() == data.paint.boundingRect()) {
-            m_staticBlurTextures.erase(m_currentScreen);
+        // Only changes of the desktop's own contents are tracked, the paint region also includes areas exposed by
+        // windows above. On X11, the texture is recreated when a desktop is resized or moved.
+        if (m_settings.staticBlur.imageSource == StaticBlurImageSource::DesktopWallpaper && w->isDesktop()) {
+            const bool damaged = m_damagedDesktops.erase(w);
+            const auto it = m_staticBlurTextures.find(m_currentScreen);
+            if (w->frameGeometry() == data.paint.boundingRect()) {
+                // Repaints of the whole desktop are often caused by changes that barely affect the blurred image, such
+                // as hovering an icon, so the desktop is compared to the one the texture was created from first.
+                if (it == m_staticBlurTextures.end() || it->second.fingerprint.isNull()) {
+                    m_staticBlurTextures.erase(m_currentScreen);
+                } else if (it->second.outdated) {
+                    m_staticBlurRecreateTimer.start();
+                } else if (damaged) {
+                    it->second.fingerprintCheckPending = true;
+                }
+            } else if (damaged && m_currentScreen) {
+                addStaticBlurDamage(m_currentScreen, data.paint & w->frameGeometry().toRect());
+            }
         }
     }
 
     effects->prePaintWindow(w, data, presentTime);
 
-    if (!staticBlur) {
+    // Other effects may make the window translucent or transform it, in which case its opaque region can't be used.
+    QRegion translucentBlurArea = blurArea;
+    if (BlurEffectData *blurInfo = blurData(w)) {
+        blurInfo->opaque = !(data.mask & PAINT_WINDOW_TRANSFORMED) ? windowOpaque & data.opaque : QRegion();
+        if (!blurInfo->opaque.isEmpty() && blurInfo->policy.refractionStrength.value_or(m_settings.refraction.refractionStrength) == 0) {
+            translucentBlurArea -= blurInfo->opaque;
+        }
+    }
+
+    // Only the dynamically blurred parts of windows using static blur depend on the windows below.
+    if (staticBlur) {
+        translucentBlurArea &= dynamicArea;
+    }
+    if (!staticBlur || !translucentBlurArea.isEmpty()) {
+        // The regions of the window are converted once, the accumulated regions are only converted back when they're
+        // added to the paint region.
+        const auto blurDamage = damageArea(m_currentBlur, translucentBlurArea);
         const QRegion oldOpaque = data.opaque;
-        if (data.opaque.intersects(m_currentBlur)) {
+        if (m_currentBlur.intersects(damageArea(m_currentBlur, data.opaque))) {
             // to blur an area partially we have to shrink the opaque area of a window
             QRegion newOpaque;
             for (const QRect &rect : data.opaque) {
-                newOpaque += rect.adjusted(m_expandSize, m_expandSize, -m_expandSize, -m_expandSize);
+                newOpaque += rect.adjusted(m_currentBlurExpandSize, m_currentBlurExpandSize, -m_currentBlurExpandSize, -m_currentBlurExpandSize);
             }
             data.opaque = newOpaque;
 
             // we don't have to blur a region we don't see
-            m_currentBlur -= newOpaque;
+            m_currentBlur -= coveredArea(m_currentBlur, newOpaque);
         }
 
         // if we have to paint a non-opaque part of this window that hasWindowBehind with the
         // currently blurred region we have to redraw the whole region
-        if ((data.paint - oldOpaque).intersects(m_currentBlur)) {
-            data.paint += m_currentBlur;
+        bool repaintCurrentBlur = m_currentBlur.intersects(damageArea(m_currentBlur, data.paint - oldOpaque));
+
+        // if this window or a window underneath the blurred area is painted again we have to
+        // blur everything. The paint region may already include the currently blurred region.
+        const bool blurIntersectsCurrentBlur = m_currentBlur.intersects(blurDamage);
+        if (m_paintedArea.intersects(blurDamage) || data.paint.intersects(translucentBlurArea)
+            || (repaintCurrentBlur && blurIntersectsCurrentBlur)) {
+            data.paint += translucentBlurArea;
+            // we have to check again whether we do not damage a blurred area
+            // of a window
+            repaintCurrentBlur |= blurIntersectsCurrentBlur;
+        }
+        if (repaintCurrentBlur) {
+            data.paint += toRegion(m_currentBlur);
+        }
+
+        // Windows whose blur region is entirely covered by their own opaque content don't need blur
+        m_currentBlur |= blurDamage;
+        if (!translucentBlurArea.isEmpty()) {
+            data.mask |= Effect::PAINT_WINDOW_TRANSLUCENT;
+            if (const BlurEffectData *blurInfo = blurData(w)) {
+                m_currentBlurExpandSize = std::max(m_currentBlurExpandSize, expandSize(blurInfo->policy, m_currentScreen ? m_currentScreen->scale() : 1.0));
+            }
+        }
+    }
+
+    m_paintedArea -= coveredArea(m_paintedArea, data.opaque);
+    m_paintedArea |= damageArea(m_paintedArea, data.paint);
+
+    m_paintedWindows.push_back(PaintedWindow{
+        .window = w,
+        .opaque = data.opaque,
+    });
+    if (!blurArea.isEmpty()) {
+        m_paintedBlurredWindowCount++;
+    }
+}
+
+void BlurEffect::updateVisibleBlurRegions()
+{
+    m_visibleBlurRegionsDirty = false;
+
+    QRegion covered;
+    int remaining = m_paintedBlurredWindowCount;
+    for (auto it = m_paintedWindows.rbegin(); it != m_paintedWindows.rend() && remaining > 0; ++it) {
+        if (BlurEffectData *blurInfo = blurData(it->window)) {
+            const QRegion blurArea = blurRegion(it->window).translated(it->window->pos().toPoint());
+            blurInfo->occluded = covered.intersects(blurArea);
+            blurInfo->visible = blurInfo->occluded ? blurArea - covered : QRegion();
+            if (!blurArea.isEmpty()) {
+                remaining--;
+            }
+        }
+        covered += it->opaque;
+    }
+}
+
+bool BlurEffect::shouldBlur(const EffectWindow *w, int mask, const WindowPaintData &data)
+{
+    const bool hasForceBlurRole = w->data(WindowForceBlurRole).toBool();
+    if ((effects->activeFullScreenEffect() && !hasForceBlurRole) || w->isDesktop()) {
+        return false;
+    }
+
+    bool scaled = !qFuzzyCompare(data.xScale(), 1.0) && !qFuzzyCompare(data.yScale(), 1.0);
+    bool translated = data.xTranslation() || data.yTranslation();
+    const auto index = m_windows.find(w);
+    if (!(scaled || (translated || (mask & PAINT_WINDOW_TRANSFORMED)))) {
+        if (index != m_windows.InvalidIndex) {
+            m_windows.setFlag(index, BlurWhenTransformed, false);
+        }
+
+        return true;
+    }
+
+    // The force blur role may be removed while the window is still transformed, causing the blur to disappear for
+    // a short time. To avoid that, we allow the window to be blurred until it's not transformed anymore.
+    if (index != m_windows.InvalidIndex && m_windows.testFlag(index, BlurWhenTransformed)) {
+        return true;
+    } else if (hasForceBlurRole && index != m_windows.InvalidIndex) {
+        m_windows.setFlag(index, BlurWhenTransformed);
+    }
+
+    return hasForceBlurRole;
+}
+
+BlurRule BlurEffect::resolveBlurRule(const EffectWindow *w) const
+{
+    if (m_settings.rules.rules.isEmpty()) {
+        return {};
+    }
+
+    WindowType type = WindowType::Normal;
+    if (isMenu(w)) {
+        type = WindowType::Menu;
+    } else if (w->isDock()) {
+        type = WindowType::Dock;
+    } else if (w->isTooltip()) {
+        type = WindowType::Tooltip;
+    }
+
+    const auto resourceName = w->window()->resourceName();
+    const auto resourceClass = w->window()->resourceClass();
+    for (const BlurRule &rule : m_settings.rules.rules) {
+        if (rule.windowType.has_value() && rule.windowType != type) {
+            continue;
+        }
+        if (!rule.windowClass.isEmpty() && !rule.windowClass.matches(resourceName) && !rule.windowClass.matches(resourceClass)) {
+            continue;
+        }
+        return rule;
+    }
+
+    return {};
+}
+
+bool BlurEffect::shouldForceBlur(const EffectWindow *w)
+{
+    const auto windowClass = w->window()->resourceClass();
+    const auto layer = w->window()->layer();
+    if (w->isDesktop()
+        || (!m_settings.forceBlur.blurDocks && w->isDock())
+        || (!m_settings.forceBlur.blurMenus && isMenu(w))
+        || windowClass == "xwaylandvideobridge"
+        || ((windowClass == "spectacle" || windowClass == "org.kde.spectacle")
+            && (layer == Layer::OverlayLayer || layer == Layer::ActiveLayer))) {
+        return false;
+    }
+
+    const auto index = m_windows.find(w);
+    bool matches;
+    if (index != m_windows.InvalidIndex && m_windows.testFlag(index, WindowClassMatchCached)) {
+        matches = m_windows.testFlag(index, WindowClassMatches);
+    } else {
+        matches = m_settings.forceBlur.windowClasses.matches(w->window()->resourceName())
+            || m_settings.forceBlur.windowClasses.matches(windowClass);
+        if (index != m_windows.InvalidIndex) {
+            m_windows.setFlag(index, WindowClassMatchCached);
+            m_windows.setFlag(index, WindowClassMatches, matches);
         }
+    }
+
+    return (matches && m_settings.forceBlur.windowClassMatchingMode == WindowClassMatchingMode::Whitelist)
+        || (!matches && m_settings.forceBlur.windowClassMatchingMode == WindowClassMatchingMode::Blacklist);
+}
+
+void BlurEffect::drawWindow(const RenderTarget &renderTarget, const RenderViewport &viewport, EffectWindow *w, int mask, const QRegion &region, WindowPaintData &data)
+{
+    if (BlurEffectData *blurInfo = m_skipScreen ? nullptr : blurData(w)) {
+        if (m_visibleBlurRegionsDirty) {
+            updateVisibleBlurRegions();
+        }
+        BlurRenderData &renderInfo = blurInfo->render[m_currentScreen];
+        if (shouldBlur(w, mask, data)) {
+            blur(renderInfo, blurInfo, renderTarget, viewport, w, mask, region, data);
+        }
+    }
+
+    // Draw the window over the blurred area
+    effects->drawWindow(renderTarget, viewport, w, mask, region, data);
+
+    if (w->isDesktop() && !m_skipScreen) {
+        captureDesktop(renderTarget, viewport, w, mask, region, data);
+    }
+}
+
+void BlurEffect::captureDesktop(const RenderTarget &renderTarget, const RenderViewport &viewport, EffectWindow *desktop, int mask, const QRegion &region, const WindowPaintData &data)
+{
+    if (!m_currentScreen || !m_staticBlurNeeded || m_settings.staticBlur.imageSource != StaticBlurImageSource::DesktopWallpaper) {
+        return;
+    }
+
+    // A texture is only created from the desktop if there is none or the outdated one is being recreated, and a window
+    // on this output uses it.
+    const auto build = m_staticBlurBuilds.find(m_currentScreen);
+    const bool needed = build != m_staticBlurBuilds.end()
+        ? build->second.stage == StaticBlurBuild::Stage::Capture
+        : !m_staticBlurTextures.contains(m_currentScreen);
+    if (!needed) {
+        return;
+    }
+
+    // Windows above the desktop haven't been painted yet, but the parts of the render target that weren't repainted
+    // contain the previous frame. The desktop also has to be painted as it is.
+    const QRect geometry = desktop->frameGeometry().toRect();
+    if (effects->activeFullScreenEffect() || (mask & PAINT_WINDOW_TRANSFORMED) || data.opacity() != 1.0
+        || data.brightness() != 1.0 || data.saturation() != 1.0
+        || (region != infiniteRegion() && !(QRegion(geometry) - region).isEmpty()) || !viewport.renderRect().contains(geometry)) {
+        return;
+    }
+
+    const QSize size = snapToPixelGrid(scaledRect(desktop->rect(), viewport.scale() / staticBlurTextureDivisor())).size();
+    auto texture = GLTexture::allocate(renderTarget.texture() ? renderTarget.texture()->internalFormat() : GL_RGBA8, size);
+    if (!texture) {
+        return;
+    }
+    texture->setFilter(GL_LINEAR);
+    texture->setWrapMode(GL_CLAMP_TO_EDGE);
+    GLFramebuffer framebuffer(texture.get());
+    if (!framebuffer.valid()) {
+        return;
+    }
+    framebuffer.blitFromRenderTarget(renderTarget, viewport, geometry, QRect(QPoint(), size));
+    m_desktopCapture = std::move(texture);
+}
+
+const StaticBlurTexture *BlurEffect::ensureStaticBlurTexture(const Output *output, const RenderTarget &renderTarget)
+{
+    GLenum textureFormat = GL_RGBA8;
+    if (renderTarget.texture()) {
+        textureFormat = renderTarget.texture()->internalFormat();
+    }
+
+    if (const auto it = m_staticBlurTextures.find(output); it != m_staticBlurTextures.end()) {
+        StaticBlurTexture &texture = it->second;
+        if (texture.fingerprintCheckPending || texture.fingerprintReadback) {
+            checkStaticBlurFingerprint(output, texture);
+        }
+
+        // The outdated texture is used until the new one is complete. Damage that occurred since the desktop was
+        // captured is applied to the new texture as well.
+        if (auto buildIt = m_staticBlurBuilds.find(output); buildIt != m_staticBlurBuilds.end() && buildIt->second.lastAdvance != m_presentTime) {
+            StaticBlurBuild &build = buildIt->second;
+            build.lastAdvance = m_presentTime;
+            advanceStaticBlurBuild(output, build, renderTarget, textureFormat, m_settings.staticBlur.stepsPerFrame);
+            if (build.stage == StaticBlurBuild::Stage::Complete) {
+                if (build.texture) {
+                    qCDebug(KWIN_BLUR) << "Recreated static blur texture for" << output->name() << "in" << build.frames
+                                       << "frames, total" << build.time.count() / 1000 << "us, longest step"
+                                       << build.longestStep.count() / 1000 << "us";
+                    texture.texture = std::move(build.texture);
+                    texture.texture->setFilter(GL_LINEAR);
+                    texture.texture->setWrapMode(GL_CLAMP_TO_EDGE);
+                    texture.size = build.size;
+                    texture.fingerprint = build.fingerprint ? build.fingerprint->take().convertToFormat(QImage::Format_RGBA8888) : QImage();
+                    texture.outdated = false;
+                    cacheStaticBlurTexture({texture.size, output->scale(), textureFormat}, texture,
+                                           textureFormat == GL_RGBA8 && renderTarget.colorDescription() == ColorDescription::sRGB);
+                }
+                m_staticBlurBuilds.erase(buildIt);
+            }
+        }
+
+        if (texture.damage.isEmpty() || updateStaticBlurTexture(output, texture, renderTarget, textureFormat)) {
+            return &texture;
+        }
+        m_staticBlurTextures.erase(it);
+    }
+
+    if (effects->waylandDisplay() && !output) {
+        return nullptr;
+    }
+
+    // Wallpapers are identified by a fingerprint of the desktop, custom images only by the size.
+    EffectWindow *desktop = output ? desktopWindow(output) : nullptr;
+    QImage fingerprint;
+    StaticBlurCache::Key cacheKey;
+    if (desktop) {
+        if (m_settings.staticBlur.imageSource == StaticBlurImageSource::DesktopWallpaper) {
+            fingerprint = desktopFingerprint(desktop);
+        }
+        cacheKey = {snapToPixelGrid(scaledRect(desktop->rect(), output->scale())).size(), output->scale(), textureFormat};
+        if (auto cached = m_staticBlurCache.find(cacheKey, fingerprint, s_fingerprintThreshold)) {
+            StaticBlurTexture &texture = m_staticBlurTextures[output];
+            texture.texture = std::move(cached);
+            texture.size = cacheKey.size;
+            texture.fingerprint = fingerprint;
+            return &texture;
+        }
+    }
+
+    // HDR and wide color gamut textures aren't stored on disk.
+    const bool persistent = desktop && textureFormat == GL_RGBA8 && renderTarget.colorDescription() == ColorDescription::sRGB;
+    const QByteArray diskCacheKey = persistent ? staticBlurDiskCacheKey(cacheKey) : QByteArray();
+
+    StaticBlurTexture texture;
+    if (persistent && !m_staticBlurDiskCacheMisses.contains(diskCacheKey)) {
+        texture.texture = m_staticBlurDiskCache.load(diskCacheKey, fingerprint, s_fingerprintThreshold);
+        texture.size = cacheKey.size;
+    }
+    const bool loaded = texture.texture != nullptr;
+    if (!loaded) {
+        texture = effects->waylandDisplay()
+            ? createStaticBlurTextureWayland(output, renderTarget, textureFormat)
+            : createStaticBlurTextureX11(textureFormat);
+    }
+    if (!texture.texture) {
+        // Creating the texture fails until the custom image is loaded, which clears the misses.
+        if (persistent && m_settings.staticBlur.imageSource == StaticBlurImageSource::Custom) {
+            m_staticBlurDiskCacheMisses.insert(diskCacheKey);
+        }
+        return nullptr;
+    }
+    texture.texture->setFilter(GL_LINEAR);
+    texture.texture->setWrapMode(GL_CLAMP_TO_EDGE);
+    texture.fingerprint = fingerprint;
+    if (desktop) {
+        cacheStaticBlurTexture(cacheKey, texture, persistent && !loaded);
+    }
+
+    return &(m_staticBlurTextures[output] = std::move(texture));
+}
+
+void BlurEffect::cacheStaticBlurTexture(const StaticBlurCache::Key &cacheKey, const StaticBlurTexture &texture, bool persistent)
+{
+    m_staticBlurCache.insert(cacheKey, texture.fingerprint, texture.texture);
+    if (persistent) {
+        if (auto readback = TextureReadback::start(texture.texture.get())) {
+            m_pendingDiskCacheStores.push_back({staticBlurDiskCacheKey(cacheKey), texture.fingerprint, std::move(readback)});
+        }
+    }
+}
 
-        // if this window or a window underneath the blurred area is painted again we have to
-        // blur everything
-        if (m_paintedArea.intersects(blurArea) || data.paint.intersects(blurArea)) {
-            data.paint += blurArea;
-            // we have to check again whether we do not damage a blurred area
-            // of a window
-            if (blurArea.intersects(m_currentBlur)) {
-                data.paint += m_currentBlur;
-            }
+void BlurEffect::storeStaticBlurTextures()
+{
+    for (auto it = m_pendingDiskCacheStores.begin(); it != m_pendingDiskCacheStores.end();) {
+        if (!it->readback->isReady()) {
+            ++it;
+            continue;
         }
 
-        m_currentBlur += blurArea;
-        if (!blurArea.isEmpty()) {
-            data.mask |= Effect::PAINT_WINDOW_TRANSLUCENT;
+        const QImage image = it->readback->take();
+        if (!image.isNull()) {
+            m_staticBlurDiskCache.store(it->key, it->fingerprint, image);
         }
+        it = m_pendingDiskCacheStores.erase(it);
     }
+}
 
-    m_paintedArea -= data.opaque;
-    m_paintedArea += data.paint;
+QByteArray BlurEffect::staticBlurDiskCacheKey(const StaticBlurCache::Key &cacheKey) const
+{
+    QByteArray key;
+    QDataStream stream(&key, QIODevice::WriteOnly);
+    stream << cacheKey.size << cacheKey.scale << cacheKey.format
+           << m_settings.general.blurStrength << m_settings.general.noiseStrength
+           << m_settings.general.brightness << m_settings.general.saturation << m_settings.general.contrast
+           << static_cast<int>(m_settings.staticBlur.imageSource) << m_settings.staticBlur.blurCustomImage
+           << staticBlurTextureDivisor();
+    if (m_settings.staticBlur.imageSource == StaticBlurImageSource::Custom) {
+        const QFileInfo image(m_settings.staticBlur.customImage);
+        stream << image.absoluteFilePath() << m_settings.staticBlur.customImageLastModified << image.size();
+    }
+    return key;
 }
 
-bool BlurEffect::shouldBlur(const EffectWindow *w, int mask, const WindowPaintData &data)
+std::unique_ptr<TextureReadback> BlurEffect::readDesktopFingerprint(EffectWindow *desktop)
 {
-    const bool hasForceBlurRole = w->data(WindowForceBlurRole).toBool();
-    if ((effects->activeFullScreenEffect() && !hasForceBlurRole) || w->isDesktop()) {
-        return false;
-    }
+    const std::unique_ptr<GLTexture> texture(wallpaper(desktop, static_cast<qreal>(s_fingerprintWidth) / desktop->width(), GL_RGBA8));
+    return TextureReadback::start(texture.get());
+}
 
-    bool scaled = !qFuzzyCompare(data.xScale(), 1.0) && !qFuzzyCompare(data.yScale(), 1.0);
-    bool translated = data.xTranslation() || data.yTranslation();
-    if (!(scaled || (translated || (mask & PAINT_WINDOW_TRANSFORMED)))) {
-        if (m_blurWhenTransformed.contains(w)) {
-            m_blurWhenTransformed.removeOne(w);
+QImage BlurEffect::desktopFingerprint(EffectWindow *desktop)
+{
+    const std::unique_ptr<TextureReadback> readback = readDesktopFingerprint(desktop);
+    return readback ? readback->take().convertToFormat(QImage::Format_RGBA8888) : QImage();
+}
+
+void BlurEffect::checkStaticBlurFingerprint(const Output *output, StaticBlurTexture &texture)
+{
+    if (!texture.fingerprintReadback) {
+        texture.fingerprintCheckPending = false;
+        EffectWindow *desktop = desktopWindow(output);
+        texture.fingerprintReadback = desktop ? readDesktopFingerprint(desktop) : nullptr;
+        if (texture.fingerprintReadback) {
+            return;
         }
+    } else if (!texture.fingerprintReadback->isReady()) {
+        return;
+    }
 
-        return true;
+    const QImage fingerprint = texture.fingerprintReadback ? texture.fingerprintReadback->take().convertToFormat(QImage::Format_RGBA8888) : QImage();
+    texture.fingerprintReadback.reset();
+    if (fingerprint.size() == texture.fingerprint.size()
+        && StaticBlurCache::fingerprintDifference(fingerprint, texture.fingerprint) <= s_fingerprintThreshold) {
+        return;
     }
 
-    // The force blur role may be removed while the window is still transformed, causing the blur to disappear for
-    // a short time. To avoid that, we allow the window to be blurred until it's not transformed anymore.
-    if (m_blurWhenTransformed.contains(w)) {
-        return true;
-    } else if (hasForceBlurRole) {
-        m_blurWhenTransformed.append(w);
+    // Switching to a desktop or activity with a recently shown wallpaper doesn't need to wait for the changes to stop.
+    const StaticBlurCache::Key cacheKey{texture.size, output->scale(), texture.texture->internalFormat()};
+    if (auto cached = m_staticBlurCache.find(cacheKey, fingerprint, s_fingerprintThreshold)) {
+        texture.texture = std::move(cached);
+        texture.fingerprint = fingerprint;
+        texture.damage = QRegion();
+        return;
     }
 
-    return hasForceBlurRole;
+    texture.outdated = true;
+    m_staticBlurRecreateTimer.start();
 }
 
-bool BlurEffect::shouldForceBlur(const EffectWindow *w) const
+void BlurEffect::recreateOutdatedStaticBlurTextures()
 {
-    const auto windowClass = w->window()->resourceClass();
-    const auto layer = w->window()->layer();
-    if (w->isDesktop()
-        || (!m_settings.forceBlur.blurDocks && w->isDock())
-        || (!m_settings.forceBlur.blurMenus && isMenu(w))
-        || windowClass == "xwaylandvideobridge"
-        || ((windowClass == "spectacle" || windowClass == "org.kde.spectacle")
-            && (layer == Layer::OverlayLayer || layer == Layer::ActiveLayer))) {
-        return false;
-    }
+    // The composite texture on X11 covers all desktops and is recreated at once.
+    bool changed = false;
+    for (auto it = m_staticBlurTextures.begin(); it != m_staticBlurTextures.end();) {
+        if (!it->second.outdated) {
+            ++it;
+            continue;
+        }
+        changed = true;
+        if (!it->first) {
+            it = m_staticBlurTextures.erase(it);
+            continue;
+        }
 
-    bool matches = m_settings.forceBlur.windowClasses.contains(w->window()->resourceName())
-        || m_settings.forceBlur.windowClasses.contains(w->window()->resourceClass());
-    return (matches && m_settings.forceBlur.windowClassMatchingMode == WindowClassMatchingMode::Whitelist)
-        || (!matches && m_settings.forceBlur.windowClassMatchingMode == WindowClassMatchingMode::Blacklist);
+        if (m_staticBlurBuilds.contains(it->first)) {
+            effects->makeOpenGLContextCurrent();
+        }
+        StaticBlurBuild &build = m_staticBlurBuilds[it->first];
+        build = StaticBlurBuild();
+        build.staged = true;
+        ++it;
+    }
+    if (changed) {
+        effects->addRepaintFull();
+    }
 }
 
-void BlurEffect::drawWindow(const RenderTarget &renderTarget, const RenderViewport &viewport, EffectWindow *w, int mask, const QRegion &region, WindowPaintData &data)
+void BlurEffect::addStaticBlurDamage(const Output *output, const QRegion &damage)
 {
-    auto it = m_windows.find(w);
-    if (it != m_windows.end()) {
-        BlurEffectData &blurInfo = it->second;
-        BlurRenderData &renderInfo = blurInfo.render[m_currentScreen];
-        if (shouldBlur(w, mask, data)) {
-            blur(renderInfo, renderTarget, viewport, w, mask, region, data);
-        }
+    const auto it = m_staticBlurTextures.find(output);
+    if (it == m_staticBlurTextures.end()) {
+        return;
     }
+    StaticBlurTexture &texture = it->second;
 
-    // Draw the window over the blurred area
-    effects->drawWindow(renderTarget, viewport, w, mask, region, data);
+    // The blur spreads the change to the surrounding pixels.
+    const QRect geometry = output->geometry();
+    const int margin = expandSize(BlurRule(), output->scale());
+    for (const QRect &rect : damage) {
+        texture.damage += rect.adjusted(-margin, -margin, margin, margin) & geometry;
+    }
+
+    // Updating most of the texture tile by tile is slower than recreating it.
+    qint64 damagedArea = 0;
+    for (const QRect &rect : texture.damage) {
+        damagedArea += static_cast<qint64>(rect.width()) * rect.height();
+    }
+    if (damagedArea * 2 > static_cast<qint64>(geometry.width()) * geometry.height()) {
+        m_staticBlurTextures.erase(it);
+    }
 }
 
-GLTexture *BlurEffect::ensureStaticBlurTexture(const Output *output, const RenderTarget &renderTarget)
+bool BlurEffect::updateStaticBlurTexture(const Output *output, StaticBlurTexture &texture, const RenderTarget &renderTarget, const GLenum &textureFormat)
 {
-    if (m_staticBlurTextures.contains(output)) {
-        return m_staticBlurTextures[output].get();
+    EffectWindow *desktop = desktopWindow(output);
+    if (!desktop) {
+        return false;
     }
 
-    if (effects->waylandDisplay() && !output) {
-        return nullptr;
+    // The texture may also be used by other outputs, in which case it's copied first. The cached texture is updated
+    // in place, since it's still closer to the desktop than to any other.
+    const long cacheReferences = m_staticBlurCache.contains(texture.texture.get()) ? 1 : 0;
+    if (texture.texture.use_count() > 1 + cacheReferences) {
+        std::shared_ptr<GLTexture> copy = GLTexture::allocate(textureFormat, texture.texture->size());
+        if (!copy) {
+            return false;
+        }
+        GLFramebuffer sourceFramebuffer(texture.texture.get());
+        if (!sourceFramebuffer.valid()) {
+            return false;
+        }
+        GLFramebuffer::pushFramebuffer(&sourceFramebuffer);
+        copy->bind();
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, copy->width(), copy->height());
+        copy->unbind();
+        GLFramebuffer::popFramebuffer();
+        copy->setFilter(GL_LINEAR);
+        copy->setWrapMode(GL_CLAMP_TO_EDGE);
+        texture.texture = std::move(copy);
     }
 
-    GLenum textureFormat = GL_RGBA8;
-    if (renderTarget.texture()) {
-        textureFormat = renderTarget.texture()->internalFormat();
+    const int divisor = staticBlurTextureDivisor();
+    const qreal scale = output->scale() / divisor;
+    const QRect textureRect(QPoint(), texture.texture->size());
+
+    // Nearby changes are merged into the same tiles, so that the same area isn't blurred multiple times.
+    QRegion tiles;
+    for (const QRect &rect : std::as_const(texture.damage)) {
+        const QRect deviceRect = scaledRect(rect.translated(-desktop->pos().toPoint()), scale).toAlignedRect() & textureRect;
+        if (deviceRect.isEmpty()) {
+            continue;
+        }
+        for (int y = deviceRect.top() / s_staticBlurTileSize; y <= deviceRect.bottom() / s_staticBlurTileSize; ++y) {
+            for (int x = deviceRect.left() / s_staticBlurTileSize; x <= deviceRect.right() / s_staticBlurTileSize; ++x) {
+                tiles += QRect(x * s_staticBlurTileSize, y * s_staticBlurTileSize, s_staticBlurTileSize, s_staticBlurTileSize) & textureRect;
+            }
+        }
     }
-    GLTexture *texture = effects->waylandDisplay()
-        ? createStaticBlurTextureWayland(output, renderTarget, textureFormat)
-        : createStaticBlurTextureX11(textureFormat);
-    if (!texture) {
-        return nullptr;
+    texture.damage = QRegion();
+
+    // Each tile is rendered and blurred with a margin, so that the pixels near its edges are blurred the same way as
+    // in the full texture, and only its center is copied.
+    const int margin = expandSize(BlurRule(), divisor);
+    for (const QRect &tile : tiles) {
+        const QRect area = tile.adjusted(-margin, -margin, margin, margin) & textureRect;
+        const std::unique_ptr<GLTexture> wallpaperTexture(wallpaper(desktop, scale, textureFormat, area));
+        if (!wallpaperTexture) {
+            return false;
+        }
+        const std::unique_ptr<GLTexture> patch = transformColorspace(wallpaperTexture.get(), ColorDescription::sRGB, renderTarget, textureFormat);
+        if (!patch) {
+            return false;
+        }
+        if (m_settings.staticBlur.blurCustomImage) {
+            blur(patch.get(), std::countr_zero(static_cast<unsigned>(divisor)));
+        }
+
+        GLFramebuffer patchFramebuffer(patch.get());
+        if (!patchFramebuffer.valid()) {
+            return false;
+        }
+        GLFramebuffer::pushFramebuffer(&patchFramebuffer);
+        texture.texture->bind();
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, tile.x(), tile.y(), tile.x() - area.x(), tile.y() - area.y(), tile.width(), tile.height());
+        texture.texture->unbind();
+        GLFramebuffer::popFramebuffer();
     }
 
-    return (m_staticBlurTextures[output] = std::unique_ptr<GLTexture>(texture)).get();
+    return true;
+}
+
+int BlurEffect::staticBlurTextureDivisor() const
+{
+    // Unblurred images would lose detail, and noise would be smeared when the texture is upscaled. Scaling down by
+    // more than 4 saves little memory and makes the upscaling visible at low strengths.
+    if (!m_settings.staticBlur.blurCustomImage || m_settings.general.noiseStrength > 0) {
+        return 1;
+    }
+    return 1 << std::min<size_t>(m_iterationCount - 1, 2);
 }
 
 GLTexture *BlurEffect::ensureNoiseTexture()
@@ -742,8 +1779,65 @@ GLTexture *BlurEffect::ensureNoiseTexture()
     return noiseTexture.get();
 }
 
-void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarget, const RenderViewport &viewport, EffectWindow *w, int mask, const QRegion &region, WindowPaintData &data)
+void BlurEffect::scheduleBlurRefresh(BlurRenderData &renderInfo, std::chrono::milliseconds delay)
+{
+    if (!renderInfo.refreshTimer) {
+        renderInfo.refreshTimer = std::make_unique<QTimer>();
+        renderInfo.refreshTimer->setSingleShot(true);
+        // The timer is destroyed along with the render data, so the reference can't dangle.
+        renderInfo.refreshTimer->callOnTimeout([&renderInfo]() {
+            effects->addRepaint(renderInfo.staleBackground);
+        });
+    }
+    if (!renderInfo.refreshTimer->isActive()) {
+        renderInfo.refreshTimer->start(delay);
+    }
+}
+
+GLTexture *BlurEffect::ensureShapeMask(BlurRenderData &renderInfo, const QRegion &shape, const QSize &deviceSize, qreal scale)
+{
+    if (renderInfo.shapeMask && renderInfo.shapeMask->size() == deviceSize && renderInfo.shapeMaskRegion == shape) {
+        return renderInfo.shapeMask.get();
+    }
+
+    QImage maskImage(deviceSize, QImage::Format_Grayscale8);
+    maskImage.fill(0);
+    QPainter painter(&maskImage);
+    for (const QRect &rect : shape) {
+        painter.fillRect(snapToPixelGrid(scaledRect(rect, scale)), Qt::white);
+    }
+    painter.end();
+
+    renderInfo.shapeMask = GLTexture::upload(maskImage);
+    if (!renderInfo.shapeMask) {
+        renderInfo.shapeMaskRegion = QRegion();
+        return nullptr;
+    }
+    renderInfo.shapeMask->setFilter(GL_NEAREST);
+    renderInfo.shapeMask->setWrapMode(GL_CLAMP_TO_EDGE);
+    renderInfo.shapeMaskRegion = shape;
+
+    return renderInfo.shapeMask.get();
+}
+
+void BlurEffect::blur(BlurRenderData &renderInfo, const BlurEffectData *windowData, const RenderTarget &renderTarget, const RenderViewport &viewport, EffectWindow *w, int mask, const QRegion &region, WindowPaintData &data, BlurPart part)
 {
+    static const BlurRule s_noRule;
+    static const BlurStyle s_noStyle;
+    const BlurRule &policy = windowData ? windowData->policy : s_noRule;
+    const BlurStyle &style = windowData ? windowData->style : s_noStyle;
+    const bool transformed = data.xScale() != 1 || data.yScale() != 1 || data.xTranslation() || data.yTranslation()
+        || (mask & PAINT_WINDOW_TRANSFORMED);
+
+    // Windows using static blur that are partially in front of other windows are split. The dynamic part is drawn first,
+    // since it fetches the background from the render target. Transformed windows use the static blur texture only.
+    if (part == BlurPart::Whole && w && windowData && !transformed && m_windows.testFlag(m_windows.find(w), HasWindowBehind)
+        && m_settings.staticBlur.disableWhenWindowBehind && hasStaticBlur(w) && ensureStaticBlurTexture(m_currentScreen, renderTarget)) {
+        blur(renderInfo, windowData, renderTarget, viewport, w, mask, region, data, BlurPart::Dynamic);
+        blur(renderInfo, windowData, renderTarget, viewport, w, mask, region, data, BlurPart::Static);
+        return;
+    }
+
     // Compute the effective blur shape. Note that if the window is transformed, so will be the blur shape.
     QRegion blurShape = w ? blurRegion(w).translated(w->pos().toPoint()) : region;
     if (data.xScale() != 1 || data.yScale() != 1) {
@@ -761,51 +1855,116 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
         blurShape.translate(std::round(data.xTranslation()), std::round(data.yTranslation()));
     }
 
-    const QRect backgroundRect = blurShape.boundingRect();
+    // Parts of the blur shape covered by the window's own opaque content or by opaque windows above aren't visible, so
+    // they are not blurred. The rounded corners still belong to the whole blur shape. Refraction depends on the whole
+    // shape as well, it's not applied when the window is split.
+    const float refractionStrength = w && part == BlurPart::Whole ? policy.refractionStrength.value_or(m_settings.refraction.refractionStrength) : 0;
+    const QRect cornerRect = blurShape.boundingRect();
+    const QRegion unculledShape = blurShape;
+    QRect backgroundRect = cornerRect;
+    // The part of the background rect that is fetched and blurred.
+    QRect fetchRect = cornerRect;
+    if (windowData && !transformed && refractionStrength == 0) {
+        // Fullscreen effects may paint windows outside of the normal stacking order.
+        const bool occluded = windowData->occluded && !effects->activeFullScreenEffect();
+        if (!windowData->opaque.isEmpty()) {
+            blurShape -= windowData->opaque;
+            if (blurShape.isEmpty()) {
+                return;
+            }
+            backgroundRect = blurShape.boundingRect();
+        }
+        if (occluded) {
+            blurShape &= windowData->visible;
+        }
+        if (part == BlurPart::Dynamic) {
+            blurShape &= windowData->windowBehind;
+        } else if (part == BlurPart::Static) {
+            blurShape -= windowData->windowBehind;
+        }
+        if (blurShape.isEmpty()) {
+            return;
+        }
+
+        // The offscreen textures cover the whole background rect, which only changes along with the window's own
+        // opaque region, so that they aren't reallocated while the visible part changes, for example when a window
+        // above is moved. Only the visible part and the area around it, which is painted for blurring the edges, see
+        // prePaintWindow, is fetched and blurred.
+        fetchRect = blurShape.boundingRect();
+        if (occluded || part == BlurPart::Dynamic) {
+            const int expand = expandSize(policy, viewport.scale());
+            fetchRect = fetchRect.adjusted(-expand, -expand, expand, expand) & backgroundRect;
+        } else {
+            fetchRect = backgroundRect;
+        }
+    }
+
     const QRect deviceBackgroundRect = snapToPixelGrid(scaledRect(backgroundRect, viewport.scale()));
+    const QRect deviceCornerRect = snapToPixelGrid(scaledRect(cornerRect, viewport.scale()));
+    // Relative to the bottom-left corner of the background rect, since texture coordinates start there.
+    const QVector4D cornerRectUniform(deviceCornerRect.x() - deviceBackgroundRect.x(),
+                                      (deviceBackgroundRect.y() + deviceBackgroundRect.height()) - (deviceCornerRect.y() + deviceCornerRect.height()),
+                                      deviceCornerRect.width(),
+                                      deviceCornerRect.height());
     const auto opacity = w && m_settings.general.windowOpacityAffectsBlur
         ? w->opacity() * data.opacity()
         : data.opacity();
 
-    QList<QRectF> effectiveShape;
-    effectiveShape.reserve(blurShape.rectCount());
-    if (region != infiniteRegion()) {
-        for (const QRect &clipRect : region) {
-            const QRectF deviceClipRect = snapToPixelGridF(scaledRect(clipRect, viewport.scale()))
-                    .translated(-deviceBackgroundRect.topLeft());
-            for (const QRect &shapeRect : blurShape) {
-                const QRectF deviceShapeRect = snapToPixelGridF(scaledRect(shapeRect.translated(-backgroundRect.topLeft()), viewport.scale()));
-                if (const QRectF intersected = deviceClipRect.intersected(deviceShapeRect); !intersected.isEmpty()) {
-                    effectiveShape.append(intersected);
-                }
+    // Shapes with too many rects are expanded to a grid to merge nearby rects. If that's not enough, the whole
+    // background rect is drawn and the shape is applied using a mask. The shape before culling is simplified, since it
+    // only changes when the window does, and the result is clipped to the bounds of the visible part. Culling doesn't
+    // need to be exact, the covered parts are painted over anyway, but the parts of split windows must not overlap.
+    QRegion shape = blurShape;
+    if (blurShape.rectCount() > m_settings.general.maxBlurRegionRects) {
+        if (renderInfo.complexShape != unculledShape) {
+            renderInfo.complexShape = unculledShape;
+            renderInfo.simplifiedShape = simplifyRegion(unculledShape, m_settings.general.blurRegionTolerance);
+        }
+        shape = renderInfo.simplifiedShape;
+        if (blurShape != unculledShape) {
+            QRegion bounds(blurShape.boundingRect());
+            if (part == BlurPart::Dynamic) {
+                bounds &= windowData->windowBehind;
+            } else if (part == BlurPart::Static) {
+                bounds -= windowData->windowBehind;
             }
+            shape &= bounds;
         }
+    } else if (!renderInfo.complexShape.isEmpty()) {
+        renderInfo.complexShape = QRegion();
+        renderInfo.simplifiedShape = QRegion();
+    }
+    const bool useShapeMask = shape.rectCount() > m_settings.general.maxBlurRegionRects;
+    if (!useShapeMask && renderInfo.shapeMask) {
+        renderInfo.shapeMask.reset();
+        renderInfo.shapeMaskRegion = QRegion();
+    }
+
+    // QRegion stores rects in y-x bands, so the clip can be merged into the shape in linear time instead of
+    // intersecting every pair of rects.
+    QRegion clippedShape;
+    if (useShapeMask) {
+        clippedShape = region != infiniteRegion() ? region & fetchRect : QRegion(fetchRect);
     } else {
-        for (const QRect &rect : blurShape) {
-            effectiveShape.append(snapToPixelGridF(scaledRect(rect.translated(-backgroundRect.topLeft()), viewport.scale())));
-        }
+        clippedShape = region != infiniteRegion() ? shape & region : shape;
+    }
+
+    QList<QRectF> effectiveShape;
+    effectiveShape.reserve(clippedShape.rectCount());
+    for (const QRect &rect : clippedShape) {
+        effectiveShape.append(snapToPixelGridF(scaledRect(rect.translated(-backgroundRect.topLeft()), viewport.scale())));
     }
     if (effectiveShape.isEmpty()) {
         return;
     }
 
-    float topCornerRadius = 0;
-    float bottomCornerRadius = 0;
-    if (w && !(w->isDock() && !isDockFloating(w, blurShape))) {
-        const bool isMaximized = effects->clientArea(MaximizeArea, effects->activeScreen(), effects->currentDesktop()) == w->frameGeometry();
-        if (isMenu(w)) {
-            topCornerRadius = bottomCornerRadius = m_settings.roundedCorners.menuRadius;
-        } else if (w->isDock()) {
-            topCornerRadius = bottomCornerRadius = m_settings.roundedCorners.dockRadius;
-        } else if ((!w->isFullScreen() && !isMaximized) || m_settings.roundedCorners.roundMaximized) {
-            if (!w->decoration() || (w->decoration() && m_settings.forceBlur.blurDecorations)) {
-                topCornerRadius = m_settings.roundedCorners.windowTopRadius;
-            }
-            bottomCornerRadius = m_settings.roundedCorners.windowBottomRadius;
-        }
-        topCornerRadius = topCornerRadius * viewport.scale();
-        bottomCornerRadius = bottomCornerRadius * viewport.scale();
-    }
+    const float topCornerRadius = style.topCornerRadius * viewport.scale();
+    const float bottomCornerRadius = style.bottomCornerRadius * viewport.scale();
+
+    size_t iterationCount;
+    float offset;
+    blurStrength(policy, iterationCount, offset);
+    iterationCount -= std::min(renderInfo.skippedIterations, iterationCount - 1);
 
     // Maybe reallocate offscreen render targets. Keep in mind that the first one contains
     // original background behind the window, it's not blurred.
@@ -816,24 +1975,31 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
 
     // Since the VBO is shared, the texture needs to be blurred before the geometry is uploaded, otherwise it will be
     // reset.
-    GLTexture *staticBlurTexture = nullptr;
-    if (w && hasStaticBlur(w)) {
+    const StaticBlurTexture *staticBlurTexture = nullptr;
+    if (w && part != BlurPart::Dynamic && hasStaticBlur(w)) {
         staticBlurTexture = ensureStaticBlurTexture(m_currentScreen, renderTarget);
-        if (staticBlurTexture) {
+        // The offscreen textures of split windows are kept for the dynamic part.
+        if (staticBlurTexture && part == BlurPart::Whole) {
             renderInfo.textures.clear();
             renderInfo.framebuffers.clear();
         }
+        // Keep painting until the texture that is being recreated is complete, or the fingerprint is compared.
+        if (m_staticBlurBuilds.contains(m_currentScreen) || (staticBlurTexture && staticBlurTexture->fingerprintReadback)) {
+            w->addRepaintFull();
+        }
     }
 
+    bool reallocated = false;
     if (!staticBlurTexture
-        && (renderInfo.framebuffers.size() != (m_iterationCount + 1)
+        && (renderInfo.framebuffers.size() != (iterationCount + 1)
             || renderInfo.textures[0]->size() != deviceBackgroundRect.size()
             || renderInfo.textures[0]->internalFormat() != textureFormat)) {
         renderInfo.framebuffers.clear();
         renderInfo.textures.clear();
         glClearColor(0, 0, 0, 0);
+        reallocated = true;
 
-        for (size_t i = 0; i <= m_iterationCount; ++i) {
+        for (size_t i = 0; i <= iterationCount; ++i) {
             // For very small windows, the width and/or height of the last blur texture may be 0. Creation of
             // and/or usage of invalid textures to create framebuffers appears to cause performance issues.
             // https://github.com/taj-ny/kwin-effects-forceblur/issues/160
@@ -867,13 +2033,43 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
         }
     }
 
+    // Rules may limit how often the background is blurred. Until the limit allows the next refresh, the previous
+    // result in framebuffers[1] is reused and the background isn't fetched. The parts of the background that changed
+    // in the meantime are only valid in the render target when they are repainted, so they are repainted once the
+    // limit allows it, and the refresh waits until then.
+    // Parts that weren't fetched during the last refresh don't contain the background yet.
+    const QRect localFetchRect = fetchRect.translated(-backgroundRect.topLeft());
+    bool refresh = true;
+    if (!staticBlurTexture && !reallocated && policy.maxRefreshRate.has_value() && renderInfo.fetchedRect.contains(localFetchRect)) {
+        const std::chrono::milliseconds interval(1000 / *policy.maxRefreshRate);
+        const std::chrono::milliseconds elapsed = m_presentTime - renderInfo.lastRefresh;
+        const QRegion staleBackground = renderInfo.staleBackground - region;
+        refresh = elapsed >= interval && staleBackground.isEmpty();
+        if (!refresh) {
+            renderInfo.staleBackground = (staleBackground + region) & fetchRect;
+            scheduleBlurRefresh(renderInfo, std::max(interval - elapsed, std::chrono::milliseconds(0)));
+        }
+    }
+
     // Fetch the pixels behind the shape that is going to be blurred.
-    if (!staticBlurTexture) {
-        const QRegion dirtyRegion = region & backgroundRect;
+    if (!staticBlurTexture && refresh) {
+        const QRegion dirtyRegion = region & fetchRect;
         for (const QRect &dirtyRect : dirtyRegion) {
             const auto destination = snapToPixelGrid(scaledRect(dirtyRect, viewport.scale())).translated(-deviceBackgroundRect.topLeft());
             renderInfo.framebuffers[0]->blitFromRenderTarget(renderTarget, viewport, dirtyRect, destination);
         }
+        renderInfo.fetchedRect = localFetchRect;
+        renderInfo.lastRefresh = m_presentTime;
+        renderInfo.staleBackground = QRegion();
+    }
+
+    GLTexture *shapeMask = nullptr;
+    if (useShapeMask) {
+        shapeMask = ensureShapeMask(renderInfo, shape.translated(-backgroundRect.topLeft()), deviceBackgroundRect.size(), viewport.scale());
+        if (!shapeMask) {
+            qCWarning(KWIN_BLUR) << "Failed to create the blur shape mask";
+            return;
+        }
     }
 
     // Upload the geometry: the first 6 vertices are used when downsampling and upsampling offscreen,
@@ -888,9 +2084,17 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
 
         size_t vboIndex = 0;
 
-        // The geometry that will be blurred offscreen, in logical pixels.
+        // The geometry that will be blurred offscreen, in device pixels. It covers the fetched part of the background,
+        // aligned to the pixels of the smallest texture, and one more of them, so that the edges of the fetched part
+        // are covered in all textures.
         {
-            const QRectF localRect = QRectF(0, 0, deviceBackgroundRect.width(), deviceBackgroundRect.height());
+            const int alignment = 1 << iterationCount;
+            const QRect deviceFetchRect = snapToPixelGrid(scaledRect(localFetchRect, viewport.scale()));
+            const QRectF localRect = QRect(QPoint((deviceFetchRect.left() / alignment - 1) * alignment,
+                                                  (deviceFetchRect.top() / alignment - 1) * alignment),
+                                           QPoint((deviceFetchRect.right() / alignment + 2) * alignment - 1,
+                                                  (deviceFetchRect.bottom() / alignment + 2) * alignment - 1))
+                & QRect(QPoint(0, 0), deviceBackgroundRect.size());
 
             const float x0 = localRect.left();
             const float y0 = localRect.top();
@@ -993,15 +2197,24 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
         }
 
         m_texture.shader->setUniform(m_texture.mvpMatrixLocation, projectionMatrix);
-        m_texture.shader->setUniform(m_texture.textureSizeLocation, QVector2D(staticBlurTexture->size().width(), staticBlurTexture->size().height()));
+        m_texture.shader->setUniform(m_texture.textureSizeLocation, QVector2D(staticBlurTexture->size.width(), staticBlurTexture->size.height()));
         m_texture.shader->setUniform(m_texture.texStartPosLocation, QVector2D(deviceBackgroundRect.x() - screenGeometry.x(), deviceBackgroundRect.y() - screenGeometry.y()));
         m_texture.shader->setUniform(m_texture.blurSizeLocation, QVector2D(deviceBackgroundRect.width(), deviceBackgroundRect.height()));
         m_texture.shader->setUniform(m_texture.topCornerRadiusLocation, topCornerRadius);
         m_texture.shader->setUniform(m_texture.bottomCornerRadiusLocation, bottomCornerRadius);
+        m_texture.shader->setUniform(m_texture.cornerRectLocation, cornerRectUniform);
         m_texture.shader->setUniform(m_texture.antialiasingLocation, m_settings.roundedCorners.antialiasing);
         m_texture.shader->setUniform(m_texture.opacityLocation, static_cast<float>(opacity));
+        m_texture.shader->setUniform(m_texture.useShapeMaskLocation, shapeMask != nullptr);
+
+        if (shapeMask) {
+            glUniform1i(m_texture.shapeMaskLocation, 2);
+            glActiveTexture(GL_TEXTURE2);
+            shapeMask->bind();
+            glActiveTexture(GL_TEXTURE0);
+        }
 
-        staticBlurTexture->bind();
+        staticBlurTexture->texture->bind();
         glEnable(GL_BLEND);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
@@ -1012,14 +2225,14 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
     }
     else {
         // The downsample pass of the dual Kawase algorithm: the background will be scaled down 50% every iteration.
-        {
+        if (refresh) {
             ShaderManager::instance()->pushShader(m_downsamplePass.shader.get());
 
             QMatrix4x4 projectionMatrix;
             projectionMatrix.ortho(QRectF(0.0, 0.0, deviceBackgroundRect.width(), deviceBackgroundRect.height()));
 
             m_downsamplePass.shader->setUniform(m_downsamplePass.mvpMatrixLocation, projectionMatrix);
-            m_downsamplePass.shader->setUniform(m_downsamplePass.offsetLocation, float(m_offset));
+            m_downsamplePass.shader->setUniform(m_downsamplePass.offsetLocation, offset);
             m_downsamplePass.shader->setUniform(m_downsamplePass.colorMatrixLocation, m_colorMatrix);
             m_downsamplePass.shader->setUniform(m_downsamplePass.transformColorsLocation, true);
 
@@ -1054,26 +2267,30 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
         m_upsamplePass.shader->setUniform(m_upsamplePass.bottomCornerRadiusLocation, static_cast<float>(0));
         m_upsamplePass.shader->setUniform(m_upsamplePass.mvpMatrixLocation, projectionMatrix);
         m_upsamplePass.shader->setUniform(m_upsamplePass.noiseLocation, false);
-        m_upsamplePass.shader->setUniform(m_upsamplePass.offsetLocation, float(m_offset));
+        m_upsamplePass.shader->setUniform(m_upsamplePass.useShapeMaskLocation, false);
+        m_upsamplePass.shader->setUniform(m_upsamplePass.offsetLocation, offset);
 
         // apply refraction ONLY on the last pass, otherwise this ends in weird stacking
         m_upsamplePass.shader->setUniform(m_upsamplePass.refractionStrengthLocation, static_cast<float>(0));
 
-        for (size_t i = renderInfo.framebuffers.size() - 1; i > 1; --i) {
-            GLFramebuffer::popFramebuffer();
-            const auto &read = renderInfo.framebuffers[i];
+        if (refresh) {
+            for (size_t i = renderInfo.framebuffers.size() - 1; i > 1; --i) {
+                GLFramebuffer::popFramebuffer();
+                const auto &read = renderInfo.framebuffers[i];
+
+                const QVector2D halfpixel(0.5 / read->colorAttachment()->width(),
+                                          0.5 / read->colorAttachment()->height());
+                m_upsamplePass.shader->setUniform(m_upsamplePass.halfpixelLocation, halfpixel);
 
-            const QVector2D halfpixel(0.5 / read->colorAttachment()->width(),
-                                      0.5 / read->colorAttachment()->height());
-            m_upsamplePass.shader->setUniform(m_upsamplePass.halfpixelLocation, halfpixel);
+                read->colorAttachment()->bind();
 
-            read->colorAttachment()->bind();
+                vbo->draw(GL_TRIANGLES, 0, 6);
+            }
 
-            vbo->draw(GL_TRIANGLES, 0, 6);
+            GLFramebuffer::popFramebuffer();
         }
 
         // The last upsampling pass is rendered on the screen, not in framebuffers[0].
-        GLFramebuffer::popFramebuffer();
         const auto &read = renderInfo.framebuffers[1];
 
         if (m_settings.general.noiseStrength > 0) {
@@ -1087,12 +2304,20 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
             }
         }
 
+        if (shapeMask) {
+            m_upsamplePass.shader->setUniform(m_upsamplePass.useShapeMaskLocation, true);
+            glUniform1i(m_upsamplePass.shapeMaskLocation, 2);
+            glActiveTexture(GL_TEXTURE2);
+            shapeMask->bind();
+        }
+
         glUniform1i(m_upsamplePass.textureLocation, 0);
         glActiveTexture(GL_TEXTURE0);
         read->colorAttachment()->bind();
 
         m_upsamplePass.shader->setUniform(m_upsamplePass.topCornerRadiusLocation, topCornerRadius);
         m_upsamplePass.shader->setUniform(m_upsamplePass.bottomCornerRadiusLocation, bottomCornerRadius);
+        m_upsamplePass.shader->setUniform(m_upsamplePass.cornerRectLocation, cornerRectUniform);
         m_upsamplePass.shader->setUniform(m_upsamplePass.antialiasingLocation, m_settings.roundedCorners.antialiasing);
         m_upsamplePass.shader->setUniform(m_upsamplePass.blurSizeLocation, QVector2D(deviceBackgroundRect.width(), deviceBackgroundRect.height()));
         m_upsamplePass.shader->setUniform(m_upsamplePass.opacityLocation, static_cast<float>(opacity));
@@ -1105,10 +2330,10 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
                                   0.5 / read->colorAttachment()->height());
         m_upsamplePass.shader->setUniform(m_upsamplePass.halfpixelLocation, halfpixel);
 
-        if (w && m_settings.refraction.refractionStrength > 0) {
+        if (refractionStrength > 0) {
             m_upsamplePass.shader->setUniform(m_upsamplePass.edgeSizePixelsLocation,
                 std::min(m_settings.refraction.edgeSizePixels, (float)std::min(deviceBackgroundRect.width() / 2, deviceBackgroundRect.height() / 2)));
-            m_upsamplePass.shader->setUniform(m_upsamplePass.refractionStrengthLocation, m_settings.refraction.refractionStrength);
+            m_upsamplePass.shader->setUniform(m_upsamplePass.refractionStrengthLocation, refractionStrength);
             m_upsamplePass.shader->setUniform(m_upsamplePass.refractionNormalPowLocation, m_settings.refraction.refractionNormalPow);
             m_upsamplePass.shader->setUniform(m_upsamplePass.refractionRGBFringingLocation, m_settings.refraction.refractionRGBFringing);
             m_upsamplePass.shader->setUniform(m_upsamplePass.refractionTextureRepeatModeLocation, m_settings.refraction.refractionTextureRepeatMode);
@@ -1126,24 +2351,28 @@ void BlurEffect::blur(BlurRenderData &renderInfo, const RenderTarget &renderTarg
     vbo->unbindArrays();
 }
 
-void BlurEffect::blur(GLTexture *texture)
+void BlurEffect::blur(GLTexture *texture, size_t skippedIterations)
 {
     const QRect textureRect = QRect(0, 0, texture->width(), texture->height());
     auto blurredFramebuffer = std::make_unique<GLFramebuffer>(texture);
 
     BlurRenderData renderData;
+    renderData.skippedIterations = skippedIterations;
     const RenderTarget renderTarget(blurredFramebuffer.get());
     const RenderViewport renderViewport(textureRect, 1.0, renderTarget);
     WindowPaintData data;
 
     GLFramebuffer::pushFramebuffer(blurredFramebuffer.get());
-    blur(renderData, renderTarget, renderViewport, nullptr, 0, textureRect, data);
+    blur(renderData, nullptr, renderTarget, renderViewport, nullptr, 0, textureRect, data);
     GLFramebuffer::popFramebuffer();
 }
 
-GLTexture *BlurEffect::wallpaper(EffectWindow *desktop, const qreal &scale, const GLenum &textureFormat)
+GLTexture *BlurEffect::wallpaper(EffectWindow *desktop, const qreal &scale, const GLenum &textureFormat, const QRect &area)
 {
-    const auto geometry = snapToPixelGrid(scaledRect(desktop->rect(), scale));
+    const auto geometry = area.isNull() ? snapToPixelGrid(scaledRect(desktop->rect(), scale)) : area;
+    const QRectF viewportGeometry = area.isNull()
+        ? desktop->frameGeometry()
+        : QRectF(desktop->pos() + QPointF(area.topLeft()) / scale, QSizeF(area.size()) / scale);
 
     auto texture = GLTexture::allocate(textureFormat, geometry.size());
     texture->setFilter(GL_LINEAR);
@@ -1157,7 +2386,7 @@ GLTexture *BlurEffect::wallpaper(EffectWindow *desktop, const qreal &scale, cons
     }
 
     const RenderTarget renderTarget(desktopFramebuffer.get());
-    const RenderViewport renderViewport(desktop->frameGeometry(), scale, renderTarget);
+    const RenderViewport renderViewport(viewportGeometry, scale, renderTarget);
     WindowPaintData data;
 
     GLFramebuffer::pushFramebuffer(desktopFramebuffer.get());
@@ -1167,61 +2396,170 @@ GLTexture *BlurEffect::wallpaper(EffectWindow *desktop, const qreal &scale, cons
     return texture.release();
 }
 
-GLTexture *BlurEffect::createStaticBlurTextureWayland(const Output *output, const RenderTarget &renderTarget, const GLenum &textureFormat)
+EffectWindow *BlurEffect::desktopWindow(const Output *output) const
 {
-    EffectWindow *desktop = nullptr;
     for (EffectWindow *w : effects->stackingOrder()) {
         if (w && w->isDesktop() && (w->window()->output() == output)) {
-            desktop = w;
-            break;
+            return w;
         }
     }
-    if (!desktop) {
-        return nullptr;
-    }
-
-    std::unique_ptr<GLTexture> texture;
-    if (m_settings.staticBlur.imageSource == StaticBlurImageSource::DesktopWallpaper) {
-        texture.reset(wallpaper(desktop, output->scale(), textureFormat));
-    } else if (m_settings.staticBlur.imageSource == StaticBlurImageSource::Custom) {
-        texture = GLTexture::upload(m_settings.staticBlur.customImage.scaled(output->pixelSize(), Qt::AspectRatioMode::IgnoreAspectRatio, Qt::TransformationMode::SmoothTransformation));
-    }
-    if (!texture) {
-        return nullptr;
-    }
+    return nullptr;
+}
 
-    // Transform image colorspace
-    auto imageTransformedColorspaceTexture = GLTexture::allocate(textureFormat, texture->size());
-    if (!imageTransformedColorspaceTexture) {
+std::unique_ptr<GLTexture> BlurEffect::transformColorspace(GLTexture *texture, const ColorDescription &colorDescription, const RenderTarget &renderTarget, const GLenum &textureFormat)
+{
+    auto transformedTexture = GLTexture::allocate(textureFormat, texture->size());
+    if (!transformedTexture) {
         return nullptr;
     }
-    auto imageTransformedColorspaceFramebuffer = std::make_unique<GLFramebuffer>(imageTransformedColorspaceTexture.get());
-    if (!imageTransformedColorspaceFramebuffer->valid()) {
+    auto transformedFramebuffer = std::make_unique<GLFramebuffer>(transformedTexture.get());
+    if (!transformedFramebuffer->valid()) {
         return nullptr;
     }
 
-    auto *shader = ShaderManager::instance()->pushShader(ShaderTrait::MapTexture | ShaderTrait::TransformColorspace);
-    shader->setColorspaceUniforms(ColorDescription::sRGB, renderTarget.colorDescription(), RenderingIntent::RelativeColorimetricWithBPC);
+    const bool transform = colorDescription != renderTarget.colorDescription();
+    auto *shader = ShaderManager::instance()->pushShader(transform ? ShaderTrait::MapTexture | ShaderTrait::TransformColorspace : ShaderTrait::MapTexture);
+    if (transform) {
+        shader->setColorspaceUniforms(colorDescription, renderTarget.colorDescription(), RenderingIntent::RelativeColorimetricWithBPC);
+    }
     QMatrix4x4 projectionMatrix;
     projectionMatrix.scale(1, -1);
     projectionMatrix.ortho(QRect(0, 0, texture->width(), texture->height()));
     shader->setUniform(GLShader::Mat4Uniform::ModelViewProjectionMatrix, projectionMatrix);
-    GLFramebuffer::pushFramebuffer(imageTransformedColorspaceFramebuffer.get());
+    GLFramebuffer::pushFramebuffer(transformedFramebuffer.get());
 
     texture->render(texture->size());
-    texture = std::move(imageTransformedColorspaceTexture);
 
     GLFramebuffer::popFramebuffer();
     ShaderManager::instance()->popShader();
 
-    if (m_settings.staticBlur.blurCustomImage) {
-        blur(texture.get());
+    return transformedTexture;
+}
+
+StaticBlurTexture BlurEffect::createStaticBlurTextureWayland(const Output *output, const RenderTarget &renderTarget, const GLenum &textureFormat)
+{
+    StaticBlurBuild build;
+    advanceStaticBlurBuild(output, build, renderTarget, textureFormat, std::numeric_limits<int>::max());
+    return {std::move(build.texture), build.size};
+}
+
+CpuBlurParameters BlurEffect::customImageCpuBlur(const ColorDescription &colorDescription) const
+{
+    // The noise is a texture that is only available on the GPU. On HDR and wide color gamut outputs, the image is
+    // blurred after it's converted to their colorspace.
+    if (!m_settings.staticBlur.blurCustomImage || m_settings.general.noiseStrength > 0 || colorDescription != ColorDescription::sRGB) {
+        return {};
     }
 
-    return texture.release();
+    const size_t skippedIterations = std::countr_zero(static_cast<unsigned>(staticBlurTextureDivisor()));
+    return {m_iterationCount - std::min(skippedIterations, m_iterationCount - 1), static_cast<float>(m_offset), m_colorMatrix};
+}
+
+std::unique_ptr<GLTexture> BlurEffect::customImageTexture(const QSize &size, const CpuBlurParameters &blur)
+{
+    const QImage image = m_customImageLoader.image(m_settings.staticBlur.customImage, m_settings.staticBlur.customImageLastModified, size, blur);
+    if (image.isNull()) {
+        return nullptr;
+    }
+    if (!hasPixelBufferObjects()) {
+        return GLTexture::upload(image);
+    }
+
+    // The image is copied to a pixel buffer object, from which the driver can upload it without blocking.
+    auto texture = GLTexture::allocate(GL_RGBA8, image.size());
+    if (!texture) {
+        return nullptr;
+    }
+    texture->setContentTransform(OutputTransform::FlipY);
+
+    GLuint buffer = 0;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, image.sizeInBytes(), nullptr, GL_STREAM_DRAW);
+    void *data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, image.sizeInBytes(), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (data) {
+        std::memcpy(data, image.constBits(), image.sizeInBytes());
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        texture->bind();
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.width(), image.height(), GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        texture->unbind();
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &buffer);
+
+    return data ? std::move(texture) : GLTexture::upload(image);
+}
+
+void BlurEffect::advanceStaticBlurBuild(const Output *output, StaticBlurBuild &build, const RenderTarget &renderTarget, const GLenum &textureFormat, int maxSteps)
+{
+    ++build.frames;
+    for (int step = 0; step < maxSteps && build.stage != StaticBlurBuild::Stage::Complete; ++step) {
+        if (build.fence) {
+            if (glClientWaitSync(build.fence.get(), GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) {
+                return;
+            }
+            build.fence.reset();
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        runStaticBlurBuildStage(output, build, renderTarget, textureFormat);
+        const std::chrono::nanoseconds elapsed(timer.nsecsElapsed());
+        build.time += elapsed;
+        build.longestStep = std::max(build.longestStep, elapsed);
+
+        if (build.staged && build.stage != StaticBlurBuild::Stage::Complete && hasFenceSync()) {
+            build.fence.reset(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+        }
+    }
+}
+
+void BlurEffect::runStaticBlurBuildStage(const Output *output, StaticBlurBuild &build, const RenderTarget &renderTarget, const GLenum &textureFormat)
+{
+    const int divisor = staticBlurTextureDivisor();
+    switch (build.stage) {
+    case StaticBlurBuild::Stage::Capture: {
+        EffectWindow *desktop = desktopWindow(output);
+        if (!desktop) {
+            build.stage = StaticBlurBuild::Stage::Complete;
+            return;
+        }
+
+        if (m_settings.staticBlur.imageSource == StaticBlurImageSource::DesktopWallpaper) {
+            build.captured = m_desktopCapture != nullptr;
+            if (build.captured) {
+                build.texture = std::move(m_desktopCapture);
+            } else {
+                build.texture.reset(wallpaper(desktop, output->scale() / divisor, textureFormat));
+            }
+            build.size = snapToPixelGrid(scaledRect(desktop->rect(), output->scale())).size();
+            if (build.staged) {
+                build.fingerprint = readDesktopFingerprint(desktop);
+            }
+        } else if (m_settings.staticBlur.imageSource == StaticBlurImageSource::Custom) {
+            const CpuBlurParameters imageBlur = customImageCpuBlur(renderTarget.colorDescription());
+            build.texture = customImageTexture(output->pixelSize() / divisor, imageBlur);
+            build.blurred = imageBlur.iterations > 0;
+            build.size = output->pixelSize();
+        }
+        build.stage = build.texture ? StaticBlurBuild::Stage::TransformColorspace : StaticBlurBuild::Stage::Complete;
+        break;
+    }
+    case StaticBlurBuild::Stage::TransformColorspace:
+        build.texture = transformColorspace(build.texture.get(), build.captured ? renderTarget.colorDescription() : ColorDescription::sRGB, renderTarget, textureFormat);
+        build.stage = build.texture && m_settings.staticBlur.blurCustomImage && !build.blurred ? StaticBlurBuild::Stage::Blur : StaticBlurBuild::Stage::Complete;
+        break;
+    case StaticBlurBuild::Stage::Blur:
+        blur(build.texture.get(), std::countr_zero(static_cast<unsigned>(divisor)));
+        build.stage = StaticBlurBuild::Stage::Complete;
+        break;
+    case StaticBlurBuild::Stage::Complete:
+        break;
+    }
 }
 
-GLTexture *BlurEffect::createStaticBlurTextureX11(const GLenum &textureFormat)
+StaticBlurTexture BlurEffect::createStaticBlurTextureX11(const GLenum &textureFormat)
 {
     std::vector<EffectWindow *> desktops;
     QRegion desktopGeometries;
@@ -1233,13 +2571,16 @@ GLTexture *BlurEffect::createStaticBlurTextureX11(const GLenum &textureFormat)
         desktopGeometries += w->frameGeometry().toRect();
     }
 
-    auto compositeTexture = GLTexture::allocate(textureFormat, desktopGeometries.boundingRect().size());
+    // The desktops are drawn at full size, the projection scales them down to the size of the composite texture.
+    const int divisor = staticBlurTextureDivisor();
+    const QSize size = desktopGeometries.boundingRect().size();
+    auto compositeTexture = GLTexture::allocate(textureFormat, size / divisor);
     if (!compositeTexture) {
-        return nullptr;
+        return {};
     }
     auto compositeTextureFramebuffer = std::make_unique<GLFramebuffer>(compositeTexture.get());
     if (!compositeTextureFramebuffer->valid()) {
-        return nullptr;
+        return {};
     }
 
     GLFramebuffer::pushFramebuffer(compositeTextureFramebuffer.get());
@@ -1248,22 +2589,26 @@ GLTexture *BlurEffect::createStaticBlurTextureX11(const GLenum &textureFormat)
         const auto geometry = desktop->frameGeometry();
 
         std::unique_ptr<GLTexture> texture;
+        bool blurred = false;
         if (m_settings.staticBlur.imageSource == StaticBlurImageSource::DesktopWallpaper) {
-            texture.reset(wallpaper(desktop, 1, textureFormat));
+            texture.reset(wallpaper(desktop, 1.0 / divisor, textureFormat));
         } else if (m_settings.staticBlur.imageSource == StaticBlurImageSource::Custom) {
-            texture = GLTexture::upload(m_settings.staticBlur.customImage.scaled(geometry.width(), geometry.height(), Qt::AspectRatioMode::IgnoreAspectRatio, Qt::TransformationMode::SmoothTransformation));
+            const CpuBlurParameters imageBlur = customImageCpuBlur(ColorDescription::sRGB);
+            texture = customImageTexture(geometry.size().toSize() / divisor, imageBlur);
+            blurred = imageBlur.iterations > 0;
         }
         if (!texture) {
-            return nullptr;
+            return {};
         }
+        texture->setFilter(GL_LINEAR);
 
-        if (m_settings.staticBlur.blurCustomImage) {
-            blur(texture.get());
+        if (m_settings.staticBlur.blurCustomImage && !blurred) {
+            blur(texture.get(), std::countr_zero(static_cast<unsigned>(divisor)));
         }
 
         QMatrix4x4 projectionMatrix;
         projectionMatrix.scale(1, -1);
-        projectionMatrix.ortho(QRectF(QPointF(), compositeTexture->size()));
+        projectionMatrix.ortho(QRectF(QPointF(), size));
         projectionMatrix.translate(geometry.x(), geometry.y());
         binder.shader()->setUniform(GLShader::Mat4Uniform::ModelViewProjectionMatrix, projectionMatrix);
 
@@ -1271,7 +2616,7 @@ GLTexture *BlurEffect::createStaticBlurTextureX11(const GLenum &textureFormat)
     }
     GLFramebuffer::popFramebuffer();
 
-    return compositeTexture.release();
+    return {std::move(compositeTexture), size};
 }
 
 QMatrix4x4 BlurEffect::colorMatrix(const float &brightness, const float &saturation, const float &contrast) const
@@ -1308,7 +2653,105 @@ QMatrix4x4 BlurEffect::colorMatrix(const float &brightness, const float &saturat
 
 bool BlurEffect::isActive() const
 {
-    return m_valid && !effects->isScreenLocked();
+    return m_active;
+}
+
+void BlurEffect::updateActiveState()
+{
+    const bool active = m_valid && !effects->isScreenLocked() && (m_blurRegionUpdatesPending || hasVisibleBlur(nullptr));
+    if (active == m_active) {
+        return;
+    }
+
+    m_active = active;
+    ++m_activeTransitions;
+    qCDebug(KWIN_BLUR) << (active ? "Activated" : "Deactivated") << "after" << m_activeTransitions << "transitions";
+
+    // The desktop isn't tracked while the effect is inactive, so the textures created from it are compared with it
+    // again. They are only recreated if it changed, and may be found in the cache.
+    if (active) {
+        for (auto &[output, texture] : m_staticBlurTextures) {
+            if (!texture.fingerprint.isNull()) {
+                texture.fingerprintCheckPending = true;
+            }
+        }
+    }
+}
+
+bool BlurEffect::hasVisibleBlur(const Output *output)
+{
+    if (m_coveredOutputsDirty) {
+        updateCoveredOutputs();
+    }
+    if (!output) {
+        return m_coveredOutputs.size() < static_cast<size_t>(effects->screens().size());
+    }
+    return !m_coveredOutputs.contains(output);
+}
+
+void BlurEffect::updateCoveredOutputs()
+{
+    m_coveredOutputsDirty = false;
+    m_coveredOutputsAnimated = false;
+    m_coveredOutputs.clear();
+
+    // Fullscreen effects may paint any window.
+    if (effects->activeFullScreenEffect()) {
+        return;
+    }
+
+    const auto stackingOrder = effects->stackingOrder();
+    for (Output *output : effects->screens()) {
+        const QRect outputGeometry = output->geometry();
+        bool covered = true;
+
+        // Windows are checked from top to bottom until either a blurred window or an opaque window that covers the
+        // whole output is found.
+        for (auto it = stackingOrder.crbegin(); it != stackingOrder.crend(); ++it) {
+            const EffectWindow *w = *it;
+            if (!w->frameGeometry().toRect().intersects(outputGeometry)) {
+                continue;
+            }
+
+            // Blurred windows that are closing, minimized or on another desktop are only painted while an animation
+            // keeps them visible. Nothing is emitted when the animation ends, so they are checked again after the
+            // next frame.
+            if (blurData(w)) {
+                const bool hidden = w->isDeleted() || w->isMinimized() || !w->isOnCurrentDesktop()
+                    || !w->isOnCurrentActivity();
+                if (hidden && !w->windowItem()->isVisible()) {
+                    continue;
+                }
+                m_coveredOutputsAnimated |= hidden;
+                covered = false;
+                break;
+            }
+            if (w->isDeleted() || w->isMinimized() || !w->isOnCurrentDesktop() || !w->isOnCurrentActivity()) {
+                continue;
+            }
+            if (w->isFullScreen() && !w->hasAlpha() && w->opacity() == 1.0
+                && w->frameGeometry().toRect().contains(outputGeometry)) {
+                break;
+            }
+        }
+
+        if (covered) {
+            m_coveredOutputs.insert(output);
+        }
+    }
+}
+
+void BlurEffect::invalidateCoveredOutputs()
+{
+    m_coveredOutputsDirty = true;
+    scheduleActiveStateUpdate();
+}
+
+void BlurEffect::scheduleActiveStateUpdate()
+{
+    if (!m_activeStateTimer.isActive()) {
+        m_activeStateTimer.start(0);
+    }
 }
 
 bool BlurEffect::blocksDirectScanout() const
@@ -12,11 +12,22 @@
 #include "scene/item.h"
 
 #include "settings.h"
+#include "staticblurcache.h"
+#include "staticblurimage.h"
+#include "texturereadback.h"
+#include "tileregion.h"
 #include "window.h"
+#include "windowgrid.h"
+#include "windowtable.h"
 
+#include <QImage>
 #include <QList>
+#include <QSet>
+#include <QTimer>
 
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 
 
 namespace KWin
@@ -24,12 +35,131 @@ namespace KWin
 
 class BlurManagerInterface;
 
+namespace Xcb
+{
+class Property;
+}
+
+#ifdef BETTERBLUR_TILE_DAMAGE
+using DamageRegion = TileRegion;
+#else
+using DamageRegion = QRegion;
+#endif
+
 struct BlurRenderData
 {
     /// Temporary render targets needed for the Dual Kawase algorithm, the first texture
     /// contains not blurred background behind the window, it's cached.
     std::vector<std::unique_ptr<GLTexture>> textures;
     std::vector<std::unique_ptr<GLFramebuffer>> framebuffers;
+
+    /// When the blurred background was last recomputed, used to enforce the refresh rate limit of rules.
+    std::chrono::milliseconds lastRefresh{};
+    /// The part of the background fetched during the last refresh, relative to the background rect.
+    QRect fetchedRect;
+    /// Parts of the background that changed since the last refresh, in global logical coordinates.
+    QRegion staleBackground;
+    /// Repaints the stale background once the refresh rate limit allows the next refresh.
+    std::unique_ptr<QTimer> refreshTimer;
+
+    /// The last blur shape before culling that exceeded the rect limit, and its simplified version.
+    QRegion complexShape;
+    QRegion simplifiedShape;
+
+    /// Mask used instead of geometry for shapes that are too complex even after simplification.
+    std::unique_ptr<GLTexture> shapeMask;
+    QRegion shapeMaskRegion;
+
+    /// The number of blur iterations to skip, because the source has already been scaled down.
+    size_t skippedIterations = 0;
+};
+
+/**
+ * A blurred image of the desktop. It's heavily low-passed, so it may be stored at a lower resolution than the area it
+ * covers and is upscaled with linear filtering when drawn.
+ */
+struct StaticBlurTexture
+{
+    /// May be shared with other outputs and the cache.
+    std::shared_ptr<GLTexture> texture;
+    /// The size of the covered area in device pixels.
+    QSize size;
+    /// Parts of the desktop that changed since the texture was last updated, expanded by the blur footprint, in
+    /// global logical coordinates.
+    QRegion damage;
+
+    /// A heavily scaled down capture of the desktop the texture was created from, used to tell whether a repaint of
+    /// the whole desktop changed it. Null on X11.
+    QImage fingerprint;
+    /// Whether the desktop was repainted since the fingerprint was last compared.
+    bool fingerprintCheckPending = false;
+    /// The fingerprint of the desktop that is being compared. It's read back in one frame and compared in a later one,
+    /// once the GPU finished copying it.
+    std::unique_ptr<TextureReadback> fingerprintReadback;
+    /// Whether the desktop changed. The texture is recreated once the changes stop.
+    bool outdated = false;
+};
+
+/**
+ * A static blur texture that is created over several frames, while the outdated one is still used. Each stage is only
+ * started after the GPU finished the previous one, so that the cost isn't concentrated in a single frame.
+ */
+struct StaticBlurBuild
+{
+    enum class Stage {
+        Capture,
+        TransformColorspace,
+        Blur,
+        Complete,
+    };
+
+    struct FenceDeleter
+    {
+        void operator()(GLsync fence) const
+        {
+            glDeleteSync(fence);
+        }
+    };
+
+    Stage stage = Stage::Capture;
+    /// Whether the build is spread over several frames. The fingerprint is only captured by such builds.
+    bool staged = false;
+    /// Whether the texture was copied from the render target, in which case it's already in its colorspace.
+    bool captured = false;
+    /// Whether the custom image was already blurred on the CPU while it was loaded.
+    bool blurred = false;
+    /// Null if the build failed.
+    std::unique_ptr<GLTexture> texture;
+    QSize size;
+    /// Read back when the desktop is captured and taken when the build is complete.
+    std::unique_ptr<TextureReadback> fingerprint;
+    /// Signaled when the GPU finished the previous stage.
+    std::unique_ptr<std::remove_pointer_t<GLsync>, FenceDeleter> fence;
+
+    /// The presentation time of the frame in which the build last advanced.
+    std::chrono::milliseconds lastAdvance{-1};
+    int frames = 0;
+    std::chrono::nanoseconds time{};
+    std::chrono::nanoseconds longestStep{};
+};
+
+/**
+ * Properties of a window that affect how its blur is drawn, but rarely change. They are derived from the window state
+ * and the settings, and updated only when the window geometry, decoration, maximized or fullscreen state, the work
+ * area or the settings change.
+ */
+struct BlurStyle
+{
+    /// In logical pixels.
+    float topCornerRadius = 0;
+    float bottomCornerRadius = 0;
+
+    bool dockFloating = false;
+    bool maximized = false;
+
+    /// Corners of the blur region that are not covered by the blur, relative to the window. These parts of the window
+    /// can't be treated as opaque when static blur is used.
+    QRegion opaqueCornerCutouts;
 };
 
 struct BlurEffectData
@@ -40,12 +170,87 @@ struct BlurEffectData
     /// The region that should be blurred behind the frame
     std::optional<QRegion> frame;
 
+    /// The effective blur region relative to the window, derived from content and frame when they or the window
+    /// geometry change.
+    QRegion region;
+
     /// The render data per screen. Screens can have different color spaces.
     std::unordered_map<Output *, BlurRenderData> render;
 
     ItemEffect windowEffect;
 
-    bool hasWindowBehind;
+    /// The rule that applies to the window, resolved when the blur region is updated.
+    BlurRule policy;
+
+    BlurStyle style;
+
+    /// The opaque region of the window itself in the last prePaintWindow call, in global logical coordinates. Empty if
+    /// the window is translucent or transformed.
+    QRegion opaque;
+
+    /// Whether a part of the blur region is covered by opaque windows above in the current frame.
+    bool occluded = false;
+    /// The part of the blur region that isn't covered by opaque windows above, in global logical coordinates. Only
+    /// valid if occluded is true.
+    QRegion visible;
+
+    /// The parts of the frame that are in front of other windows, in global logical coordinates. Only valid if the
+    /// window has the HasWindowBehind flag.
+    QRegion windowBehind;
+};
+
+/**
+ * Window flags that are read while painting.
+ */
+enum WindowFlag : uint8_t {
+    /// The window has a BlurEffectData.
+    HasBlur = 1 << 0,
+    /// The window can be blurred even when transformed, until it's not transformed anymore.
+    BlurWhenTransformed = 1 << 1,
+    /// WindowClassMatches has been computed for the current settings.
+    WindowClassMatchCached = 1 << 2,
+    /// The window class matches the force blur window class list.
+    WindowClassMatches = 1 << 3,
+    /// Another window is behind this window, updated when any window moves or changes visibility.
+    HasWindowBehind = 1 << 4,
+    /// The value of HasWindowBehind during the last paint, used to detect when the window needs to be repainted.
+    PaintedWindowBehind = 1 << 5,
+    /// The blur region needs to be updated before the next paint.
+    BlurRegionDirty = 1 << 6,
+    /// Only the window geometry changed since the blur region was last updated.
+    BlurRegionGeometryChanged = 1 << 7,
+};
+
+enum class X11BlurRegionState {
+    /// The property hasn't been read yet.
+    Unknown,
+    /// A request has been sent, the reply will be collected later.
+    Pending,
+    Cached,
+};
+
+/**
+ * Which part of a window using static blur is drawn. Parts of the window that are in front of other windows use real
+ * blur when disableWhenWindowBehind is enabled, the rest uses the static blur texture.
+ */
+enum class BlurPart {
+    Whole,
+    /// The parts in front of other windows, always blurred dynamically.
+    Dynamic,
+    /// The parts in front of the desktop.
+    Static,
+};
+
+struct WindowState
+{
+    std::optional<BlurEffectData> blur;
+
+    /// The parsed _KDE_NET_WM_BLUR_BEHIND_REGION property. Only used on X11, refreshed when the property changes.
+    std::optional<QRegion> x11BlurRegion;
+    X11BlurRegionState x11BlurRegionState = X11BlurRegionState::Unknown;
+
+    QMetaObject::Connection blurChangedConnection;
+    QMetaObject::Connection frameGeometryChangedConnection;
 };
 
 class BlurEffect : public KWin::Effect
@@ -61,6 +266,7 @@ public:
 
     void reconfigure(ReconfigureFlags flags) override;
     void prePaintScreen(ScreenPrePaintData &data, std::chrono::milliseconds presentTime) override;
+    void postPaintScreen() override;
     void prePaintWindow(EffectWindow *w, WindowPrePaintData &data, std::chrono::milliseconds presentTime) override;
     void drawWindow(const RenderTarget &renderTarget, const RenderViewport &viewport, EffectWindow *w, int mask, const QRegion &region, WindowPaintData &data) override;
 
@@ -90,44 +296,213 @@ private:
     QRegion decorationBlurRegion(const EffectWindow *w) const;
     bool decorationSupportsBlurBehind(const EffectWindow *w) const;
     bool shouldBlur(const EffectWindow *w, int mask, const WindowPaintData &data);
-    bool shouldForceBlur(const EffectWindow *w) const;
+    bool shouldForceBlur(const EffectWindow *w);
+    BlurRule resolveBlurRule(const EffectWindow *w) const;
+    /**
+     * @return The blur data of the window, or nullptr if the window isn't blurred.
+     */
+    BlurEffectData *blurData(const EffectWindow *w);
+    const BlurEffectData *blurData(const EffectWindow *w) const;
+    void removeBlurData(const EffectWindow *w);
     void updateBlurRegion(EffectWindow *w, bool geometryChanged = false);
+    /**
+     * Marks the blur region of the window as outdated. The region will be updated in the next prePaintScreen call,
+     * so that multiple changes in a single frame only cause one update.
+     */
+    void scheduleBlurRegionUpdate(EffectWindow *w, bool geometryChanged = false);
+    void updateScheduledBlurRegions();
+    QRegion effectiveBlurRegion(EffectWindow *w, const BlurEffectData &data) const;
+    /**
+     * @return The cached X11 blur region of the window. The property is read if it hasn't been read yet, unless a
+     * request for it is pending.
+     */
+    std::optional<QRegion> x11BlurRegion(EffectWindow *w);
+    void readX11BlurRegion(EffectWindow *w);
+    /**
+     * Sends requests for the X11 blur regions of all windows at once. The replies are collected in the next event loop
+     * iteration by collectX11BlurRegions.
+     */
+    void requestX11BlurRegions();
+    void collectX11BlurRegions();
+    void updateBlurStyle(EffectWindow *w);
+    void updateBlurStyle(EffectWindow *w, BlurEffectData &data) const;
+    /// Updates the styles of all blurred windows, for example after the work area changed.
+    void updateBlurStyles();
+    /**
+     * @return Whether the static blur texture is used for the window, or at least for the parts that are not in front
+     * of other windows.
+     */
     bool hasStaticBlur(EffectWindow *w);
+    /**
+     * @return The part of the blur area of a window using static blur that is blurred dynamically because it's in front
+     * of other windows, including the area around it that is needed for blurring its edges.
+     */
+    QRegion dynamicBlurArea(EffectWindow *w, const QRegion &blurArea) const;
+    /// Whether the window can be behind a blurred window and prevent it from using static blur.
+    bool canBeBehindBlurredWindow(const EffectWindow *w) const;
+    void updateWindowGrid(EffectWindow *w);
+    void rebuildWindowGrid();
+    void updateHasWindowBehind();
+    /**
+     * Walks the windows painted in the current frame from top to bottom and computes which parts of the blur regions
+     * are covered by opaque windows above.
+     */
+    void updateVisibleBlurRegions();
+    /**
+     * @param output The output, or nullptr for any output.
+     * @return Whether a blurred window may be visible on the output. Outputs that are covered by an opaque fullscreen
+     * window, or don't show any blurred windows, are skipped entirely.
+     */
+    bool hasVisibleBlur(const Output *output);
+    void updateCoveredOutputs();
+    void invalidateCoveredOutputs();
+    /**
+     * Computes whether the effect is active and tracks transitions between the active and inactive state. Called
+     * after the coverage changes and in prePaintScreen, isActive() only returns the result, since it's called by the
+     * compositor and must be cheap and free of side effects.
+     */
+    void updateActiveState();
+    void scheduleActiveStateUpdate();
+    /// Whether static blur textures may be needed by any window.
+    bool staticBlurInUse() const;
     QMatrix4x4 colorMatrix(const float &brightness, const float &saturation, const float &contrast) const;
 
+    /**
+     * Computes the number of iterations and the offset to use for a window, taking the rule into account.
+     */
+    void blurStrength(const BlurRule &policy, size_t &iterationCount, float &offset) const;
+
+    /**
+     * @return How far, in logical pixels, the blur of a window reads outside of any given pixel. Opaque windows above
+     * a blurred window need to be shrunk by this amount so that the pixels the blur depends on are painted.
+     */
+    int expandSize(const BlurRule &policy, qreal scale) const;
+
     /*
+     * @param windowData The blur data of the window, nullptr if an image is being blurred.
      * @param w The pointer to the window being blurred, nullptr if an image is being blurred.
      */
-    void blur(BlurRenderData &renderInfo, const RenderTarget &renderTarget, const RenderViewport &viewport, EffectWindow *w, int mask, const QRegion &region, WindowPaintData &data);
-    void blur(GLTexture *texture);
+    void blur(BlurRenderData &renderInfo, const BlurEffectData *windowData, const RenderTarget &renderTarget, const RenderViewport &viewport, EffectWindow *w, int mask, const QRegion &region, WindowPaintData &data, BlurPart part = BlurPart::Whole);
+    void blur(GLTexture *texture, size_t skippedIterations = 0);
 
     /**
      * @param output Can be nullptr.
      * @remark This method shall not be called outside of BlurEffect::blur.
      * @return The cached static blur texture. The texture will be created if it doesn't exist.
      */
-    GLTexture *ensureStaticBlurTexture(const Output *output, const RenderTarget &renderTarget);
+    const StaticBlurTexture *ensureStaticBlurTexture(const Output *output, const RenderTarget &renderTarget);
+    /**
+     * @return The factor by which static blur textures are scaled down. The blur is applied to the scaled down image
+     * with correspondingly fewer iterations.
+     */
+    int staticBlurTextureDivisor() const;
+    /**
+     * Marks a part of the static blur texture of the output as outdated. The texture is recreated if most of it is
+     * outdated.
+     * @param damage In global logical coordinates.
+     */
+    void addStaticBlurDamage(const Output *output, const QRegion &damage);
+    /**
+     * Re-renders and blurs the tiles of the texture that intersect its damage.
+     * @remark This method shall not be called outside of BlurEffect::blur.
+     * @return Whether the texture was updated. If not, it needs to be recreated.
+     */
+    bool updateStaticBlurTexture(const Output *output, StaticBlurTexture &texture, const RenderTarget &renderTarget, const GLenum &textureFormat);
+    /**
+     * @remark This method shall not be called outside of BlurEffect::blur.
+     * @return The readback of a heavily scaled down capture of the desktop, or nullptr if an error occurred.
+     */
+    std::unique_ptr<TextureReadback> readDesktopFingerprint(EffectWindow *desktop);
+    /**
+     * Like readDesktopFingerprint, but waits for the GPU. Only used when a static blur texture is needed right away.
+     * @return The fingerprint, or a null image if an error occurred.
+     */
+    QImage desktopFingerprint(EffectWindow *desktop);
+    /**
+     * @return The key identifying static blur textures on disk, derived from the cache key, the settings that affect
+     * the texture and, for custom images, the image file.
+     */
+    QByteArray staticBlurDiskCacheKey(const StaticBlurCache::Key &cacheKey) const;
+    /**
+     * Compares the current fingerprint of the desktop to the one the texture was created from, and schedules the
+     * texture to be recreated if they differ noticeably.
+     * @remark This method shall not be called outside of BlurEffect::blur.
+     */
+    void checkStaticBlurFingerprint(const Output *output, StaticBlurTexture &texture);
+    /// Starts recreating the static blur textures whose desktop changed.
+    void recreateOutdatedStaticBlurTextures();
+    /**
+     * Runs up to the specified number of stages of the build. A stage isn't started before the GPU finished the
+     * previous one.
+     * @remark This method shall not be called outside of BlurEffect::blur.
+     */
+    void advanceStaticBlurBuild(const Output *output, StaticBlurBuild &build, const RenderTarget &renderTarget, const GLenum &textureFormat, int maxSteps);
+    void runStaticBlurBuildStage(const Output *output, StaticBlurBuild &build, const RenderTarget &renderTarget, const GLenum &textureFormat);
+    /**
+     * Adds the texture to the in-memory cache and, if it's persistent, to the disk cache. The texture is read back for
+     * the disk cache without waiting for the GPU, it's stored by storeStaticBlurTextures once the copy is complete.
+     */
+    void cacheStaticBlurTexture(const StaticBlurCache::Key &cacheKey, const StaticBlurTexture &texture, bool persistent);
+    void storeStaticBlurTextures();
     GLTexture *ensureNoiseTexture();
 
+    /**
+     * Schedules a repaint of the stale background of a window whose refresh was skipped because of the refresh rate
+     * limit, unless one is already scheduled.
+     */
+    void scheduleBlurRefresh(BlurRenderData &renderInfo, std::chrono::milliseconds delay);
+    /**
+     * @param shape The blur shape relative to the top-left corner of the background rect, in logical pixels.
+     * @return A texture that contains 1 for pixels inside the shape and 0 elsewhere.
+     */
+    GLTexture *ensureShapeMask(BlurRenderData &renderInfo, const QRegion &shape, const QSize &deviceSize, qreal scale);
+
     /**
      * @remark This method shall not be called outside of BlurEffect::blur.
      * @return A pointer to a texture containing the wallpaper of the specified desktop, or nullptr if an error
      * occurred. The texture will contain icons and widgets, if there are any.
+     * @param area The part of the desktop to render in device pixels relative to the desktop, or a null rect for the
+     * whole desktop.
+     */
+    GLTexture *wallpaper(EffectWindow *desktop, const qreal &scale, const GLenum &textureFormat, const QRect &area = QRect());
+    /**
+     * @return The desktop window shown on the output, or nullptr if there is none.
+     */
+    EffectWindow *desktopWindow(const Output *output) const;
+    /**
+     * Converts the texture to the colorspace of the render target, and flips it to the orientation of static blur
+     * textures.
+     * @return The converted texture, or nullptr if an error occurred.
+     */
+    std::unique_ptr<GLTexture> transformColorspace(GLTexture *texture, const ColorDescription &colorDescription, const RenderTarget &renderTarget, const GLenum &textureFormat);
+    /**
+     * Copies the desktop from the render target right after it has been painted, if a static blur texture is going to
+     * be created from it, so that it doesn't have to be rendered again.
      */
-    GLTexture *wallpaper(EffectWindow *desktop, const qreal &scale, const GLenum &textureFormat);
+    void captureDesktop(const RenderTarget &renderTarget, const RenderViewport &viewport, EffectWindow *desktop, int mask, const QRegion &region, const WindowPaintData &data);
 
     /**
-     * Creates a static blur texture for the specified screen.
+     * Creates a static blur texture for the specified screen in one go.
      * @remark This method shall not be called outside of BlurEffect::blur.
-     * @return A pointer to the texture, or nullptr if an error occurred.
+     * @return The texture, which is null if an error occurred.
      */
-    GLTexture *createStaticBlurTextureWayland(const Output *output, const RenderTarget &renderTarget, const GLenum &textureFormat);
+    StaticBlurTexture createStaticBlurTextureWayland(const Output *output, const RenderTarget &renderTarget, const GLenum &textureFormat);
 
     /**
      * Creates a composite static blur texture containing images for all screens.
-     * @return A pointer to the texture, or nullptr if an error occurred.
+     * @return The texture, which is null if an error occurred.
+     */
+    StaticBlurTexture createStaticBlurTextureX11(const GLenum &textureFormat);
+    /**
+     * @return How the custom image is blurred on the CPU while it's loaded, with no iterations if it's blurred on the
+     * GPU or not at all.
      */
-    GLTexture *createStaticBlurTextureX11(const GLenum &textureFormat);
+    CpuBlurParameters customImageCpuBlur(const ColorDescription &colorDescription) const;
+    /**
+     * Uploads the custom image scaled to the size, which is decoded, scaled and blurred in a worker thread.
+     * @return The texture, which is null if the image isn't ready yet or couldn't be decoded.
+     */
+    std::unique_ptr<GLTexture> customImageTexture(const QSize &size, const CpuBlurParameters &blur);
 
 private:
     struct
@@ -154,6 +529,7 @@ private:
 
         int topCornerRadiusLocation;
         int bottomCornerRadiusLocation;
+        int cornerRectLocation;
         int antialiasingLocation;
         int blurSizeLocation;
         int opacityLocation;
@@ -163,6 +539,9 @@ private:
         int refractionNormalPowLocation;
         int refractionRGBFringingLocation;
         int refractionTextureRepeatModeLocation;
+
+        int useShapeMaskLocation;
+        int shapeMaskLocation;
     } m_upsamplePass;
 
     struct
@@ -174,26 +553,32 @@ private:
 
         int topCornerRadiusLocation;
         int bottomCornerRadiusLocation;
+        int cornerRectLocation;
         int antialiasingLocation;
         int blurSizeLocation;
         int opacityLocation;
+
+        int useShapeMaskLocation;
+        int shapeMaskLocation;
     } m_texture;
 
     bool m_valid = false;
     long net_wm_blur_region = 0;
-    QRegion m_paintedArea; // keeps track of all painted areas (from bottom to top)
-    QRegion m_currentBlur; // keeps track of the currently blured area of the windows(from bottom to top)
+    DamageRegion m_paintedArea; // keeps track of all painted areas (from bottom to top)
+    DamageRegion m_currentBlur; // keeps track of the currently blured area of the windows(from bottom to top)
     Output *m_currentScreen = nullptr;
+    std::chrono::milliseconds m_presentTime{};
 
     size_t m_iterationCount; // number of times the texture will be downsized to half size
     int m_offset;
-    int m_expandSize;
+    int m_currentBlurExpandSize = 0; // the largest expand size of the windows in m_currentBlur
 
     std::unique_ptr<GLTexture> noiseTexture;
     qreal noiseTextureScale = 1.0;
     int noiseTextureStength = 0;
 
     BlurSettings m_settings;
+    bool m_settingsRead = false;
 
     struct OffsetStruct
     {
@@ -212,26 +597,74 @@ private:
 
     QList<BlurValuesStruct> blurStrengthValues;
 
-    std::unordered_map<const Output*, std::unique_ptr<GLTexture>> m_staticBlurTextures;
-
-    // Windows to blur even when transformed.
-    QList<const EffectWindow*> m_blurWhenTransformed;
+    std::unordered_map<const Output*, StaticBlurTexture> m_staticBlurTextures;
+    StaticBlurCache m_staticBlurCache;
+    std::unordered_map<const Output*, StaticBlurBuild> m_staticBlurBuilds;
+    /// The desktop of the output being painted, copied from the render target at the static blur texture scale.
+    std::unique_ptr<GLTexture> m_desktopCapture;
+    StaticBlurDiskCache m_staticBlurDiskCache;
+    /// Keys that aren't on disk while the custom image is loading, so that the disk isn't probed every frame.
+    QSet<QByteArray> m_staticBlurDiskCacheMisses;
+    struct PendingDiskCacheStore
+    {
+        QByteArray key;
+        QImage fingerprint;
+        std::unique_ptr<TextureReadback> readback;
+    };
+    std::vector<PendingDiskCacheStore> m_pendingDiskCacheStores;
+    StaticBlurImageLoader m_customImageLoader;
+    /// Desktop windows whose contents changed since they were last painted.
+    std::unordered_set<const EffectWindow *> m_damagedDesktops;
+    /// Delays recreating outdated static blur textures until the desktop stops changing, for example during a
+    /// wallpaper transition.
+    QTimer m_staticBlurRecreateTimer;
+    /// Coalesces updating the styles of all windows when the outputs or panels change.
+    QTimer m_blurStylesTimer;
 
     QMatrix4x4 m_colorMatrix;
 
-    QMap<EffectWindow *, QMetaObject::Connection> windowBlurChangedConnections;
-    QMap<EffectWindow *, QMetaObject::Connection> windowFrameGeometryChangedConnections;
     QMap<Output *, QMetaObject::Connection> screenChangedConnections;
-    std::unordered_map<EffectWindow *, BlurEffectData> m_windows;
+    std::vector<std::pair<EffectWindow *, std::unique_ptr<Xcb::Property>>> m_pendingX11BlurRegions;
+    WindowTable<WindowState> m_windows;
 
     /**
-     * Stores all currently open windows, even those that aren't blurred. Used for determining whether windows are
-     * overlapping.
+     * Stores the geometry of all visible windows that can be behind a blurred window, even those that aren't blurred.
+     * Used for determining whether windows are overlapping.
      *
      * Objects retrieved from effects->stackingOrder() and workspace()->stackingOrder() appear to be deleted when
      * BlurEffect::prePaintWindow is running, so that can't be used.
      */
-    std::vector<EffectWindow *> m_allWindows;
+    WindowGrid m_windowGrid;
+    /// Whether the HasWindowBehind flag needs to be recomputed.
+    bool m_windowBehindDirty = true;
+    /// Whether any window has the BlurRegionDirty flag.
+    bool m_blurRegionUpdatesPending = false;
+
+    struct PaintedWindow
+    {
+        EffectWindow *window;
+        /// The final opaque region of the window, used by the scene to cull windows below.
+        QRegion opaque;
+    };
+    /// The windows passed to prePaintWindow in the current frame, from bottom to top.
+    std::vector<PaintedWindow> m_paintedWindows;
+    int m_paintedBlurredWindowCount = 0;
+    bool m_visibleBlurRegionsDirty = false;
+
+    /// Outputs on which no blurred window is visible. Updated lazily when windows are added, moved, restacked or
+    /// change their visibility.
+    std::unordered_set<const Output *> m_coveredOutputs;
+    bool m_coveredOutputsDirty = true;
+    /// Whether a hidden blurred window was considered visible because it's being animated.
+    bool m_coveredOutputsAnimated = false;
+    /// Whether the effect was active when updateActiveState() was last called, and how many times that has changed.
+    bool m_active = true;
+    quint64 m_activeTransitions = 0;
+    QTimer m_activeStateTimer;
+    /// Whether the output being painted has no visible blurred windows.
+    bool m_skipScreen = false;
+    /// Whether a window using static blur is painted on the output being painted. The desktop is only captured if so.
+    bool m_staticBlurNeeded = false;
 
     static BlurManagerInterface *s_blurManager;
     static QTimer *s_blurManagerRemoveTimer;
@@ -0,0 +1,504 @@
+#include "cpublur.h"
+
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BETTERBLUR_CPU_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BETTERBLUR_CPU_NEON
+#endif
+
+namespace KWin
+{
+
+static const int s_minBandHeight = 16;
+
+namespace
+{
+
+// One RGBA pixel per vector.
+#if defined(BETTERBLUR_CPU_SSE2)
+using Vec4 = __m128;
+
+inline Vec4 load(const float *p)
+{
+    return _mm_loadu_ps(p);
+}
+inline void store(float *p, Vec4 v)
+{
+    _mm_storeu_ps(p, v);
+}
+inline Vec4 splat(float f)
+{
+    return _mm_set1_ps(f);
+}
+inline Vec4 add(Vec4 a, Vec4 b)
+{
+    return _mm_add_ps(a, b);
+}
+inline Vec4 sub(Vec4 a, Vec4 b)
+{
+    return _mm_sub_ps(a, b);
+}
+inline Vec4 mul(Vec4 a, Vec4 b)
+{
+    return _mm_mul_ps(a, b);
+}
+inline Vec4 loadBytes(const uchar *p)
+{
+    int32_t bytes;
+    std::memcpy(&bytes, p, sizeof(bytes));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+    return _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero)), _mm_set1_ps(1.0f / 255.0f));
+}
+inline void storeBytes(uchar *p, Vec4 v)
+{
+    const __m128 clamped = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    const __m128i dwords = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(clamped, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f)));
+    const __m128i words = _mm_packs_epi32(dwords, dwords);
+    const int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+    std::memcpy(p, &bytes, sizeof(bytes));
+}
+#elif defined(BETTERBLUR_CPU_NEON)
+using Vec4 = float32x4_t;
+
+inline Vec4 load(const float *p)
+{
+    return vld1q_f32(p);
+}
+inline void store(float *p, Vec4 v)
+{
+    vst1q_f32(p, v);
+}
+inline Vec4 splat(float f)
+{
+    return vdupq_n_f32(f);
+}
+inline Vec4 add(Vec4 a, Vec4 b)
+{
+    return vaddq_f32(a, b);
+}
+inline Vec4 sub(Vec4 a, Vec4 b)
+{
+    return vsubq_f32(a, b);
+}
+inline Vec4 mul(Vec4 a, Vec4 b)
+{
+    return vmulq_f32(a, b);
+}
+inline Vec4 loadBytes(const uchar *p)
+{
+    uint32_t bytes;
+    std::memcpy(&bytes, p, sizeof(bytes));
+    const uint16x8_t words = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(bytes)));
+    return vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(words))), 1.0f / 255.0f);
+}
+inline void storeBytes(uchar *p, Vec4 v)
+{
+    const float32x4_t clamped = vminq_f32(vmaxq_f32(v, vdupq_n_f32(0.0f)), vdupq_n_f32(1.0f));
+    const uint16x4_t words = vmovn_u32(vcvtq_u32_f32(vmlaq_n_f32(vdupq_n_f32(0.5f), clamped, 255.0f)));
+    const uint32_t bytes = vget_lane_u32(vreinterpret_u32_u8(vmovn_u16(vcombine_u16(words, words))), 0);
+    std::memcpy(p, &bytes, sizeof(bytes));
+}
+#else
+struct Vec4
+{
+    float v[4];
+};
+
+inline Vec4 load(const float *p)
+{
+    return {{p[0], p[1], p[2], p[3]}};
+}
+inline void store(float *p, Vec4 v)
+{
+    std::copy(v.v, v.v + 4, p);
+}
+inline Vec4 splat(float f)
+{
+    return {{f, f, f, f}};
+}
+inline Vec4 add(Vec4 a, Vec4 b)
+{
+    return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}};
+}
+inline Vec4 sub(Vec4 a, Vec4 b)
+{
+    return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]}};
+}
+inline Vec4 mul(Vec4 a, Vec4 b)
+{
+    return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}};
+}
+inline Vec4 loadBytes(const uchar *p)
+{
+    return {{p[0] / 255.0f, p[1] / 255.0f, p[2] / 255.0f, p[3] / 255.0f}};
+}
+inline void storeBytes(uchar *p, Vec4 v)
+{
+    for (int channel = 0; channel < 4; ++channel) {
+        p[channel] = static_cast<uchar>(std::clamp(v.v[channel], 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+}
+#endif
+
+inline Vec4 lerp(Vec4 a, Vec4 b, float t)
+{
+    return add(a, mul(sub(b, a), splat(t)));
+}
+
+/**
+ * An RGBA image with a float per channel, like a texture.
+ */
+struct Image
+{
+    int width = 0;
+    int height = 0;
+    std::vector<float> pixels;
+
+    Image() = default;
+    Image(int width, int height)
+        : width(width)
+        , height(height)
+        , pixels(static_cast<size_t>(width) * height * 4)
+    {
+    }
+
+    const float *pixel(int x, int y) const
+    {
+        return pixels.data() + (static_cast<size_t>(y) * width + x) * 4;
+    }
+
+    float *pixel(int x, int y)
+    {
+        return pixels.data() + (static_cast<size_t>(y) * width + x) * 4;
+    }
+};
+
+/**
+ * Multiplies the color as a row vector with the matrix, like the downsample shader.
+ * @param rows The rows of the matrix.
+ */
+Vec4 transform(Vec4 color, const Vec4 *rows)
+{
+    float channels[4];
+    store(channels, color);
+    return add(add(mul(splat(channels[0]), rows[0]), mul(splat(channels[1]), rows[1])),
+               add(mul(splat(channels[2]), rows[2]), mul(splat(channels[3]), rows[3])));
+}
+
+/**
+ * The two pixels and the weight of the second one for linear filtering along one axis with GL_CLAMP_TO_EDGE. The
+ * position is in pixels, with the pixel centers at integer coordinates.
+ */
+struct Sample
+{
+    int first;
+    int second;
+    float weight;
+};
+
+Sample sample(float position, int size)
+{
+    const float first = std::floor(position);
+    return {
+        std::clamp(static_cast<int>(first), 0, size - 1),
+        std::clamp(static_cast<int>(first) + 1, 0, size - 1),
+        position - first,
+    };
+}
+
+/**
+ * A linearly filtered sample of the source relative to the position of the target pixel, in source pixels.
+ */
+struct Tap
+{
+    float x;
+    float y;
+    float weight;
+};
+
+/**
+ * A pass of the shaders, which sums samples of the source at fixed offsets from each target pixel.
+ *
+ * Samples are filtered vertically first: the source rows are interpolated once per distinct vertical offset and target
+ * row, over the whole row. The samples of the target pixels are then interpolated horizontally between two columns of
+ * those rows. The columns and weights don't depend on the row, so they're computed once for the pass instead of for
+ * every sample.
+ */
+class Pass
+{
+public:
+    Pass(int sourceWidth, int sourceHeight, int targetWidth, int targetHeight, const std::vector<Tap> &taps)
+        : m_sourceWidth(sourceWidth)
+        , m_sourceHeight(sourceHeight)
+        , m_targetWidth(targetWidth)
+        , m_scaleY(static_cast<float>(sourceHeight) / targetHeight)
+    {
+        std::vector<float> xOffsets;
+        const auto indexOf = [](std::vector<float> &offsets, float offset) {
+            const auto it = std::find(offsets.begin(), offsets.end(), offset);
+            if (it != offsets.end()) {
+                return static_cast<int>(it - offsets.begin());
+            }
+            offsets.push_back(offset);
+            return static_cast<int>(offsets.size() - 1);
+        };
+        for (const Tap &tap : taps) {
+            m_taps.push_back({indexOf(m_yOffsets, tap.y), indexOf(xOffsets, tap.x), tap.weight});
+        }
+
+        const float scaleX = static_cast<float>(sourceWidth) / targetWidth;
+        m_columns.reserve(static_cast<size_t>(targetWidth) * xOffsets.size());
+        for (int x = 0; x < targetWidth; ++x) {
+            const float sourceX = (x + 0.5f) * scaleX - 0.5f;
+            for (float offset : xOffsets) {
+                m_columns.push_back(sample(sourceX + offset, sourceWidth));
+            }
+            m_columnsPerPixel = xOffsets.size();
+        }
+    }
+
+    /**
+     * Computes the rows from first to last.
+     * @param interpolateRows Writes the source rows interpolated with a Sample to a row of floats.
+     * @param write Writes the sum of the samples of a target pixel.
+     */
+    template<typename InterpolateRows, typename Write>
+    void run(int first, int last, const InterpolateRows &interpolateRows, const Write &write) const
+    {
+        std::vector<std::vector<float>> rows(m_yOffsets.size(), std::vector<float>(static_cast<size_t>(m_sourceWidth) * 4));
+        for (int y = first; y < last; ++y) {
+            const float sourceY = (y + 0.5f) * m_scaleY - 0.5f;
+            for (size_t i = 0; i < m_yOffsets.size(); ++i) {
+                interpolateRows(sample(sourceY + m_yOffsets[i], m_sourceHeight), rows[i].data());
+            }
+
+            const Sample *columns = m_columns.data();
+            for (int x = 0; x < m_targetWidth; ++x, columns += m_columnsPerPixel) {
+                Vec4 sum = splat(0.0f);
+                for (const PassTap &tap : m_taps) {
+                    const float *row = rows[tap.row].data();
+                    const Sample &column = columns[tap.column];
+                    sum = add(sum, mul(lerp(load(row + column.first * 4), load(row + column.second * 4), column.weight), splat(tap.weight)));
+                }
+                write(x, y, sum);
+            }
+        }
+    }
+
+private:
+    struct PassTap
+    {
+        /// Index of the vertical offset.
+        int row;
+        /// Index of the horizontal offset.
+        int column;
+        float weight;
+    };
+
+    int m_sourceWidth;
+    int m_sourceHeight;
+    int m_targetWidth;
+    float m_scaleY;
+    std::vector<float> m_yOffsets;
+    std::vector<PassTap> m_taps;
+    /// The horizontal samples of the target pixels, for each horizontal offset.
+    std::vector<Sample> m_columns;
+    size_t m_columnsPerPixel = 0;
+};
+
+/**
+ * The taps of the downsample shader. The offsets are converted from the halfpixel uniform, which is half of a source
+ * pixel.
+ */
+std::vector<Tap> downsampleTaps(float offset)
+{
+    const float diagonal = 0.5f * offset;
+    return {
+        {0, 0, 4.0f / 8.0f},
+        {-diagonal, -diagonal, 1.0f / 8.0f},
+        {diagonal, diagonal, 1.0f / 8.0f},
+        {diagonal, -diagonal, 1.0f / 8.0f},
+        {-diagonal, diagonal, 1.0f / 8.0f},
+    };
+}
+
+/**
+ * The taps of the upsample shader, without noise, refraction and rounded corners.
+ */
+std::vector<Tap> upsampleTaps(float offset)
+{
+    const float diagonal = 0.5f * offset;
+    return {
+        {-offset, 0, 1.0f / 12.0f},
+        {offset, 0, 1.0f / 12.0f},
+        {0, -offset, 1.0f / 12.0f},
+        {0, offset, 1.0f / 12.0f},
+        {-diagonal, diagonal, 2.0f / 12.0f},
+        {diagonal, diagonal, 2.0f / 12.0f},
+        {diagonal, -diagonal, 2.0f / 12.0f},
+        {-diagonal, -diagonal, 2.0f / 12.0f},
+    };
+}
+
+/**
+ * Interpolates the rows of a level, four floats at a time.
+ */
+void interpolateRows(const Image &image, const Sample &rows, float *result)
+{
+    const float *first = image.pixel(0, rows.first);
+    const float *second = image.pixel(0, rows.second);
+    const size_t count = static_cast<size_t>(image.width) * 4;
+    if (rows.first == rows.second || rows.weight == 0) {
+        std::copy(first, first + count, result);
+        return;
+    }
+    for (size_t i = 0; i < count; i += 4) {
+        store(result + i, lerp(load(first + i), load(second + i), rows.weight));
+    }
+}
+
+/**
+ * Interpolates the rows of the RGBA8888 source image, which is converted to floats on the fly.
+ */
+void interpolateRows(const QImage &image, const Sample &rows, float *result)
+{
+    const uchar *first = image.constScanLine(rows.first);
+    const uchar *second = image.constScanLine(rows.second);
+    const size_t count = static_cast<size_t>(image.width()) * 4;
+    for (size_t i = 0; i < count; i += 4) {
+        store(result + i, lerp(loadBytes(first + i), loadBytes(second + i), rows.weight));
+    }
+}
+
+/**
+ * The bands run in a pool of their own. cpuBlur is called from tasks in the global pool, which would otherwise wait for
+ * bands queued behind them.
+ */
+QThreadPool *bandPool()
+{
+    static QThreadPool pool;
+    return &pool;
+}
+
+/**
+ * Splits the rows into bands that are processed in parallel.
+ */
+template<typename Pass>
+void runInBands(int height, const Pass &pass)
+{
+    const int bandCount = std::clamp(height / s_minBandHeight, 1, QThread::idealThreadCount());
+    if (bandCount == 1) {
+        pass(0, height);
+        return;
+    }
+
+    std::vector<std::pair<int, int>> bands;
+    bands.reserve(bandCount);
+    for (int i = 0; i < bandCount; ++i) {
+        bands.emplace_back(height * i / bandCount, height * (i + 1) / bandCount);
+    }
+    QtConcurrent::blockingMap(bandPool(), bands, [&pass](const std::pair<int, int> &band) {
+        pass(band.first, band.second);
+    });
+}
+
+}
+
+QImage cpuBlur(const QImage &image, const CpuBlurParameters &parameters)
+{
+    const QImage source = image.convertToFormat(QImage::Format_RGBA8888);
+    if (source.isNull() || parameters.iterations == 0) {
+        return source;
+    }
+
+    // The sizes of the levels are the same as the sizes of the offscreen textures. The first one is the source image,
+    // which stays in the 8-bit format: the first pass reads it and the last pass writes the result directly.
+    std::vector<Image> levels(1);
+    levels.reserve(parameters.iterations + 1);
+    for (size_t i = 1; i <= parameters.iterations; ++i) {
+        levels.emplace_back(std::max(1, source.width() / (1 << i)), std::max(1, source.height() / (1 << i)));
+    }
+
+    Vec4 colorMatrix[4];
+    for (int row = 0; row < 4; ++row) {
+        const float values[4] = {
+            parameters.colorMatrix(row, 0),
+            parameters.colorMatrix(row, 1),
+            parameters.colorMatrix(row, 2),
+            parameters.colorMatrix(row, 3),
+        };
+        colorMatrix[row] = load(values);
+    }
+
+    const std::vector<Tap> downsample = downsampleTaps(parameters.offset);
+    {
+        Image &target = levels[1];
+        const Pass pass(source.width(), source.height(), target.width, target.height, downsample);
+        runInBands(target.height, [&](int first, int last) {
+            pass.run(first, last, [&source](const Sample &rows, float *result) {
+                interpolateRows(source, rows, result);
+            }, [&target, &colorMatrix](int x, int y, Vec4 color) {
+                store(target.pixel(x, y), transform(color, colorMatrix));
+            });
+        });
+    }
+    for (size_t i = 2; i < levels.size(); ++i) {
+        const Image &sourceLevel = levels[i - 1];
+        Image &target = levels[i];
+        const Pass pass(sourceLevel.width, sourceLevel.height, target.width, target.height, downsample);
+        runInBands(target.height, [&](int first, int last) {
+            pass.run(first, last, [&sourceLevel](const Sample &rows, float *result) {
+                interpolateRows(sourceLevel, rows, result);
+            }, [&target](int x, int y, Vec4 color) {
+                store(target.pixel(x, y), color);
+            });
+        });
+    }
+
+    const std::vector<Tap> upsample = upsampleTaps(parameters.offset);
+    for (size_t i = levels.size() - 1; i > 1; --i) {
+        const Image &sourceLevel = levels[i];
+        Image &target = levels[i - 1];
+        const Pass pass(sourceLevel.width, sourceLevel.height, target.width, target.height, upsample);
+        runInBands(target.height, [&](int first, int last) {
+            pass.run(first, last, [&sourceLevel](const Sample &rows, float *result) {
+                interpolateRows(sourceLevel, rows, result);
+            }, [&target](int x, int y, Vec4 color) {
+                store(target.pixel(x, y), color);
+            });
+        });
+    }
+
+    // The shader outputs the opacity as the alpha, which replaces the image when blended.
+    QImage result(source.size(), QImage::Format_RGBA8888);
+    uchar *bits = result.bits();
+    const qsizetype bytesPerLine = result.bytesPerLine();
+    const Image &sourceLevel = levels[1];
+    const Pass pass(sourceLevel.width, sourceLevel.height, result.width(), result.height(), upsample);
+    runInBands(result.height(), [&](int first, int last) {
+        pass.run(first, last, [&sourceLevel](const Sample &rows, float *result) {
+            interpolateRows(sourceLevel, rows, result);
+        }, [bits, bytesPerLine](int x, int y, Vec4 color) {
+            uchar *pixel = bits + y * bytesPerLine + x * 4;
+            storeBytes(pixel, color);
+            pixel[3] = 255;
+        });
+    });
+    return result;
+}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <QImage>
+#include <QMatrix4x4>
+
+#include <cstddef>
+
+namespace KWin
+{
+
+struct CpuBlurParameters
+{
+    /// The number of downsample passes. 0 disables blurring.
+    size_t iterations = 0;
+    float offset = 0;
+    /// Applied in the first downsample pass.
+    QMatrix4x4 colorMatrix;
+
+    bool operator==(const CpuBlurParameters &) const = default;
+};
+
+/**
+ * The dual Kawase blur implemented on the CPU, for images that are blurred once and don't need a GL context, such as
+ * the custom static blur image. The passes sample the image the same way as the downsample and upsample shaders,
+ * including bilinear filtering with clamping to the edge, so the result matches the GPU within rounding. Noise and
+ * refraction are not supported.
+ *
+ * The image itself is only read by the first pass and written by the last one, the smaller levels are stored with a
+ * float per channel. Each pass is split into bands of rows that are processed in parallel. Pixels are processed with
+ * SSE2 on x86-64, NEON on AArch64 and scalar code elsewhere. Can be called from any thread.
+ *
+ * @param image An image without premultiplied alpha.
+ * @return The blurred image in the RGBA8888 format. It's opaque, like the images produced by the shaders.
+ */
+QImage cpuBlur(const QImage &image, const CpuBlurParameters &parameters);
+
+}
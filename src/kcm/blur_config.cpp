@@ -77,9 +77,22 @@ void BlurEffectConfig::setupContextualHelp()
         ui.windowClassesContextualHelp,
         QStringLiteral("<p>Specify one window class per line.</p>") +
         QStringLiteral("<p>Use <code>$blank</code> to match empty window classes.<br/>") +
-        QStringLiteral("Use <code>$$</code> for literal dollar sign.</p>"),
+        QStringLiteral("Use <code>$$</code> for literal dollar sign.</p>") +
+        QStringLiteral("<p>Use <code>*</code> and <code>?</code> as wildcards, or enclose a regular expression in slashes, ") +
+        QStringLiteral("for example <code>/org\\.kde\\..*/</code>.</p>"),
         ui.windowClassesBriefDescription
     );
+    setContextualHelp(
+        ui.blurRulesContextualHelp,
+        QStringLiteral("<p>Specify one rule per line: <code>class [type=...] [mode=...] [iterations=...] [fps=...] [refraction=...]</code></p>") +
+        QStringLiteral("<p>Use <code>*</code> to match all window classes. The first matching rule is used.<br/>") +
+        QStringLiteral("<code>type</code>: normal, menu, dock or tooltip<br/>") +
+        QStringLiteral("<code>mode</code>: dynamic, static or off<br/>") +
+        QStringLiteral("<code>iterations</code>: maximum number of blur iterations (1-4)<br/>") +
+        QStringLiteral("<code>fps</code>: maximum number of times per second the blur is updated<br/>") +
+        QStringLiteral("<code>refraction</code>: refraction strength (0-20)</p>"),
+        ui.blurRulesBriefDescription
+    );
 }
 
 void BlurEffectConfig::save()
@@ -1,6 +1,8 @@
 #include "settings.h"
 #include "blurconfig.h"
 
+#include <QFileInfo>
+
 namespace KWin
 {
 
@@ -14,6 +16,8 @@ void BlurSettings::read()
     general.brightness = BlurConfig::brightness();
     general.saturation = BlurConfig::saturation();
     general.contrast = BlurConfig::contrast();
+    general.maxBlurRegionRects = BlurConfig::maxBlurRegionRects();
+    general.blurRegionTolerance = BlurConfig::blurRegionTolerance();
 
     forceBlur.windowClasses.clear();
     const auto blank = QStringLiteral("blank");
@@ -40,8 +44,9 @@ void BlurSettings::read()
         if (consumed) {
             unescaped += QChar('$');
         }
-        forceBlur.windowClasses << unescaped;
+        forceBlur.windowClasses.add(unescaped);
     }
+    forceBlur.windowClasses.compile();
     forceBlur.windowClassMatchingMode = BlurConfig::blurMatching() ? WindowClassMatchingMode::Whitelist : WindowClassMatchingMode::Blacklist;
     forceBlur.blurDecorations = BlurConfig::blurDecorations();
     forceBlur.blurMenus = BlurConfig::blurMenus();
@@ -56,19 +61,93 @@ void BlurSettings::read()
 
     staticBlur.enable = BlurConfig::fakeBlur();
     staticBlur.disableWhenWindowBehind = BlurConfig::fakeBlurDisableWhenWindowBehind();
-    staticBlur.customImage = QImage(BlurConfig::fakeBlurImage());
+    staticBlur.customImage = BlurConfig::fakeBlurImage();
+    staticBlur.customImageLastModified = QFileInfo(staticBlur.customImage).lastModified();
     if (BlurConfig::fakeBlurImageSourceDesktopWallpaper()) {
         staticBlur.imageSource = StaticBlurImageSource::DesktopWallpaper;
     } else {
         staticBlur.imageSource = StaticBlurImageSource::Custom;
     }
     staticBlur.blurCustomImage = BlurConfig::fakeBlurCustomImageBlur();
+    staticBlur.cacheSize = BlurConfig::fakeBlurCacheSize();
+    staticBlur.stepsPerFrame = BlurConfig::fakeBlurRegenerationStepsPerFrame();
 
     refraction.edgeSizePixels = BlurConfig::refractionEdgeSize() * 10;
     refraction.refractionStrength = BlurConfig::refractionStrength() / 20.0;
     refraction.refractionNormalPow = BlurConfig::refractionNormalPow() / 2.0;
     refraction.refractionRGBFringing = BlurConfig::refractionRGBFringing() / 20.0;  // Scale to 0-1 range
     refraction.refractionTextureRepeatMode = BlurConfig::refractionTextureRepeatMode();
+
+    readRules();
+}
+
+void BlurSettings::readRules()
+{
+    rules.rules.clear();
+    rules.anyStatic = false;
+
+    // One rule per line: <window class> [type=normal|menu|dock|tooltip] [mode=dynamic|static|off] [iterations=<n>]
+    // [fps=<n>] [refraction=<n>]. The window class is a pattern like in the force blur window class list.
+    for (const auto &line : BlurConfig::blurRules().split("\n", Qt::SkipEmptyParts)) {
+        const auto tokens = line.split(QChar(' '), Qt::SkipEmptyParts);
+        if (tokens.isEmpty() || tokens[0].startsWith(QChar('#'))) {
+            continue;
+        }
+
+        BlurRule rule;
+        if (tokens[0] != QStringLiteral("*")) {
+            rule.windowClass.add(tokens[0]);
+            rule.windowClass.compile();
+        }
+
+        for (qsizetype i = 1; i < tokens.size(); i++) {
+            const auto separator = tokens[i].indexOf(QChar('='));
+            if (separator == -1) {
+                continue;
+            }
+            const auto key = tokens[i].left(separator);
+            const auto value = tokens[i].mid(separator + 1);
+
+            bool ok = true;
+            if (key == QStringLiteral("type")) {
+                if (value == QStringLiteral("normal")) {
+                    rule.windowType = WindowType::Normal;
+                } else if (value == QStringLiteral("menu")) {
+                    rule.windowType = WindowType::Menu;
+                } else if (value == QStringLiteral("dock")) {
+                    rule.windowType = WindowType::Dock;
+                } else if (value == QStringLiteral("tooltip")) {
+                    rule.windowType = WindowType::Tooltip;
+                }
+            } else if (key == QStringLiteral("mode")) {
+                if (value == QStringLiteral("dynamic")) {
+                    rule.mode = BlurMode::Dynamic;
+                } else if (value == QStringLiteral("static")) {
+                    rule.mode = BlurMode::Static;
+                } else if (value == QStringLiteral("off")) {
+                    rule.mode = BlurMode::Off;
+                }
+            } else if (key == QStringLiteral("iterations")) {
+                const auto iterations = value.toInt(&ok);
+                if (ok && iterations > 0) {
+                    rule.maxIterations = iterations;
+                }
+            } else if (key == QStringLiteral("fps")) {
+                const auto fps = value.toInt(&ok);
+                if (ok && fps > 0) {
+                    rule.maxRefreshRate = fps;
+                }
+            } else if (key == QStringLiteral("refraction")) {
+                const auto strength = value.toFloat(&ok);
+                if (ok && strength >= 0) {
+                    rule.refractionStrength = strength / 20.0;
+                }
+            }
+        }
+
+        rules.anyStatic |= rule.mode == BlurMode::Static;
+        rules.rules << rule;
+    }
 }
 
 }
\ No newline at end of file
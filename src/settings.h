@@ -1,8 +1,12 @@
 #pragma once
 
-#include <QImage>
+#include "windowclassmatcher.h"
+
+#include <QDateTime>
 #include <QStringList>
 
+#include <optional>
+
 namespace KWin
 {
 
@@ -18,6 +22,21 @@ enum class WindowClassMatchingMode
     Whitelist
 };
 
+enum class BlurMode
+{
+    Dynamic,
+    Static,
+    Off
+};
+
+enum class WindowType
+{
+    Normal,
+    Menu,
+    Dock,
+    Tooltip
+};
+
 
 struct GeneralSettings
 {
@@ -27,15 +46,23 @@ struct GeneralSettings
     float brightness;
     float saturation;
     float contrast;
+    /// Blur regions with more rects than this are simplified, and drawn using a mask if that doesn't help.
+    int maxBlurRegionRects;
+    /// The maximum distance in logical pixels by which a simplified blur region may extend beyond the original one.
+    int blurRegionTolerance;
+
+    bool operator==(const GeneralSettings &) const = default;
 };
 
 struct ForceBlurSettings
 {
-    QStringList windowClasses;
+    WindowClassMatcher windowClasses;
     WindowClassMatchingMode windowClassMatchingMode;
     bool blurDecorations;
     bool blurMenus;
     bool blurDocks;
+
+    bool operator==(const ForceBlurSettings &) const = default;
 };
 
 struct RoundedCornersSettings
@@ -46,6 +73,8 @@ struct RoundedCornersSettings
     float dockRadius;
     float antialiasing;
     bool roundMaximized;
+
+    bool operator==(const RoundedCornersSettings &) const = default;
 };
 
 struct StaticBlurSettings
@@ -53,8 +82,16 @@ struct StaticBlurSettings
     bool enable;
     bool disableWhenWindowBehind;
     StaticBlurImageSource imageSource;
-    QImage customImage;
+    /// The path of the custom image, which is decoded when a static blur texture is created.
+    QString customImage;
+    QDateTime customImageLastModified;
     bool blurCustomImage;
+    /// The maximum total size of cached static blur textures in MiB.
+    int cacheSize;
+    /// The maximum number of stages of recreating a static blur texture that are run in a single frame.
+    int stepsPerFrame;
+
+    bool operator==(const StaticBlurSettings &) const = default;
 };
 
 struct RefractionSettings
@@ -64,6 +101,37 @@ struct RefractionSettings
     float refractionNormalPow;
     float refractionRGBFringing;
     int refractionTextureRepeatMode;
+
+    bool operator==(const RefractionSettings &) const = default;
+};
+
+/**
+ * Per-window overrides, matched by window class and type. All fields except the match criteria are optional, unset
+ * fields fall back to the global settings.
+ */
+struct BlurRule
+{
+    /// Matches any window class if empty.
+    WindowClassMatcher windowClass;
+    std::optional<WindowType> windowType;
+
+    std::optional<BlurMode> mode;
+    std::optional<int> maxIterations;
+    /// Maximum number of times per second the blurred background is recomputed.
+    std::optional<int> maxRefreshRate;
+    std::optional<float> refractionStrength;
+
+    bool operator==(const BlurRule &) const = default;
+};
+
+struct RulesSettings
+{
+    QList<BlurRule> rules;
+    /// Whether any rule forces static blur, in which case static blur textures are needed even if static blur is
+    /// disabled globally.
+    bool anyStatic;
+
+    bool operator==(const RulesSettings &) const = default;
 };
 
 class BlurSettings
@@ -74,8 +142,14 @@ public:
     RoundedCornersSettings roundedCorners{};
     StaticBlurSettings staticBlur{};
     RefractionSettings refraction{};
+    RulesSettings rules{};
 
     void read();
+
+    bool operator==(const BlurSettings &) const = default;
+
+private:
+    void readRules();
 };
 
 }
@@ -5,25 +5,31 @@ uniform float antialiasing;
 uniform vec2 blurSize;
 uniform float opacity;
 
+// The rect whose corners are rounded, relative to the bottom-left corner of the drawn rect. It's larger than the drawn
+// rect if only a part of the blur region is drawn.
+uniform vec4 cornerRect;
+
 vec4 roundedRectangle(vec2 fragCoord, vec3 texture)
 {
     if (topCornerRadius == 0 && bottomCornerRadius == 0) {
         return vec4(texture, opacity);
     }
 
-    vec2 halfblurSize = blurSize * 0.5;
-    vec2 p = fragCoord - halfblurSize;
+    fragCoord -= cornerRect.xy;
+    vec2 size = cornerRect.zw;
+    vec2 halfSize = size * 0.5;
+    vec2 p = fragCoord - halfSize;
     float radius = 0.0;
     if ((fragCoord.y <= bottomCornerRadius)
-        && (fragCoord.x <= bottomCornerRadius || fragCoord.x >= blurSize.x - bottomCornerRadius)) {
+        && (fragCoord.x <= bottomCornerRadius || fragCoord.x >= size.x - bottomCornerRadius)) {
         radius = bottomCornerRadius;
         p.y -= radius;
-    } else if ((fragCoord.y >= blurSize.y - topCornerRadius)
-        && (fragCoord.x <= topCornerRadius || fragCoord.x >= blurSize.x - topCornerRadius)) {
+    } else if ((fragCoord.y >= size.y - topCornerRadius)
+        && (fragCoord.x <= topCornerRadius || fragCoord.x >= size.x - topCornerRadius)) {
         radius = topCornerRadius;
         p.y += radius;
     }
-    float distance = length(max(abs(p) - (halfblurSize + vec2(0.0, radius)) + radius, 0.0)) - radius;
+    float distance = length(max(abs(p) - (halfSize + vec2(0.0, radius)) + radius, 0.0)) - radius;
 
     float s = smoothstep(0.0, antialiasing, distance);
     return vec4(texture, mix(1.0, 0.0, s) * opacity);
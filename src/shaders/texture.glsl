@@ -4,10 +4,17 @@ uniform sampler2D texUnit;
 uniform vec2 textureSize;
 uniform vec2 texStartPos;
 
+uniform bool useShapeMask;
+uniform sampler2D shapeMask;
+
 varying vec2 uv;
 
 void main(void)
 {
     vec2 tex = (texStartPos.xy + vec2(uv.x, 1.0 - uv.y) * blurSize) / textureSize;
-    gl_FragColor = roundedRectangle(uv * blurSize, texture2D(texUnit, tex).rgb);
+    vec4 color = roundedRectangle(uv * blurSize, texture2D(texUnit, tex).rgb);
+    if (useShapeMask) {
+        color.a *= texture2D(shapeMask, vec2(uv.x, 1.0 - uv.y)).r;
+    }
+    gl_FragColor = color;
 }
\ No newline at end of file
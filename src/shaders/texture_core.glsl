@@ -6,6 +6,9 @@ uniform sampler2D texUnit;
 uniform vec2 textureSize;
 uniform vec2 texStartPos;
 
+uniform bool useShapeMask;
+uniform sampler2D shapeMask;
+
 in vec2 uv;
 
 out vec4 fragColor;
@@ -13,5 +16,9 @@ out vec4 fragColor;
 void main(void)
 {
     vec2 tex = (texStartPos.xy + vec2(uv.x, 1.0 - uv.y) * blurSize) / textureSize;
-    fragColor = roundedRectangle(uv * blurSize, texture(texUnit, tex).rgb);
+    vec4 color = roundedRectangle(uv * blurSize, texture(texUnit, tex).rgb);
+    if (useShapeMask) {
+        color.a *= texture(shapeMask, vec2(uv.x, 1.0 - uv.y)).r;
+    }
+    fragColor = color;
 }
@@ -6,6 +6,9 @@ uniform sampler2D texUnit;
 uniform float offset;
 uniform vec2 halfpixel;
 
+uniform bool useShapeMask;
+uniform sampler2D shapeMask;
+
 uniform bool noise;
 uniform sampler2D noiseTexture;
 uniform vec2 noiseTextureSize;
@@ -119,5 +122,9 @@ void main(void)
         sum += vec4(texture(noiseTexture, gl_FragCoord.xy / noiseTextureSize).rrr, 0.0);
     }
 
-    fragColor = roundedRectangle(uv * blurSize, sum.rgb);
+    vec4 color = roundedRectangle(uv * blurSize, sum.rgb);
+    if (useShapeMask) {
+        color.a *= texture(shapeMask, vec2(uv.x, 1.0 - uv.y)).r;
+    }
+    fragColor = color;
 }
\ No newline at end of file
@@ -0,0 +1,233 @@
+#include "staticblurcache.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QRegularExpression>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace KWin
+{
+
+static const int s_fingerprintCellSize = 8;
+
+static const quint32 s_diskCacheMagic = 0x54534242; // BBST
+static const quint32 s_diskCacheVersion = 1;
+/// The total size of the files, in bytes. A single file is kept even if it's larger.
+static const qint64 s_maxDiskCacheSize = 256 * 1024 * 1024;
+
+struct DiskCacheHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint32 width;
+    quint32 height;
+    quint32 fingerprintWidth;
+    quint32 fingerprintHeight;
+};
+
+static qint64 textureSize(const GLTexture *texture)
+{
+    qint64 bytesPerPixel = 4;
+    switch (texture->internalFormat()) {
+    case GL_RGBA16F:
+    case GL_RGBA16:
+        bytesPerPixel = 8;
+        break;
+    case GL_RGBA32F:
+        bytesPerPixel = 16;
+        break;
+    }
+    return static_cast<qint64>(texture->width()) * texture->height() * bytesPerPixel;
+}
+
+std::shared_ptr<GLTexture> StaticBlurCache::find(const Key &key, const QImage &fingerprint, int maxDifference)
+{
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+        if (it->key == key && it->fingerprint.size() == fingerprint.size()
+            && fingerprintDifference(it->fingerprint, fingerprint) <= maxDifference) {
+            m_entries.splice(m_entries.begin(), m_entries, it);
+            return m_entries.front().texture;
+        }
+    }
+    return nullptr;
+}
+
+void StaticBlurCache::insert(const Key &key, const QImage &fingerprint, const std::shared_ptr<GLTexture> &texture)
+{
+    if (m_budget == 0) {
+        return;
+    }
+
+    const qint64 size = textureSize(texture.get());
+    m_entries.push_front(Entry{key, fingerprint, texture, size});
+    m_size += size;
+    evict();
+}
+
+bool StaticBlurCache::contains(const GLTexture *texture) const
+{
+    return std::any_of(m_entries.begin(), m_entries.end(), [texture](const Entry &entry) {
+        return entry.texture.get() == texture;
+    });
+}
+
+void StaticBlurCache::clear()
+{
+    m_entries.clear();
+    m_size = 0;
+}
+
+void StaticBlurCache::setBudget(qint64 budget)
+{
+    m_budget = budget;
+    evict();
+}
+
+void StaticBlurCache::evict()
+{
+    while (!m_entries.empty() && m_size > m_budget) {
+        m_size -= m_entries.back().size;
+        m_entries.pop_back();
+    }
+}
+
+int StaticBlurCache::fingerprintDifference(const QImage &a, const QImage &b)
+{
+    int maxDifference = 0;
+    for (int cellY = 0; cellY < a.height(); cellY += s_fingerprintCellSize) {
+        for (int cellX = 0; cellX < a.width(); cellX += s_fingerprintCellSize) {
+            const int cellBottom = std::min(cellY + s_fingerprintCellSize, a.height());
+            const int cellRight = std::min(cellX + s_fingerprintCellSize, a.width());
+
+            int difference = 0;
+            for (int y = cellY; y < cellBottom; ++y) {
+                const uchar *lineA = a.constScanLine(y);
+                const uchar *lineB = b.constScanLine(y);
+                for (int x = cellX * 4; x < cellRight * 4; ++x) {
+                    difference += std::abs(lineA[x] - lineB[x]);
+                }
+            }
+            maxDifference = std::max(maxDifference, difference / ((cellBottom - cellY) * (cellRight - cellX) * 4));
+        }
+    }
+    return maxDifference;
+}
+
+StaticBlurDiskCache::StaticBlurDiskCache()
+    : m_directory(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QStringLiteral("/better-blur"))
+{
+}
+
+/**
+ * @return The prefix of the names of the files stored for the key.
+ */
+static QString filePrefix(const QByteArray &key)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex()) + QLatin1Char('-');
+}
+
+/**
+ * @return Whether the file is a committed cache entry, named by the hashes of the key and the fingerprint. Files being
+ * written by QSaveFile have a suffix.
+ */
+static bool isCacheFileName(const QString &fileName)
+{
+    static const QRegularExpression pattern(QStringLiteral("^[0-9a-f]{40}-[0-9a-f]{40}$"));
+    return pattern.match(fileName).hasMatch();
+}
+
+std::unique_ptr<GLTexture> StaticBlurDiskCache::load(const QByteArray &key, const QImage &fingerprint, int maxDifference) const
+{
+    const QDir directory(m_directory);
+    const QStringList fileNames = directory.entryList({filePrefix(key) + QLatin1Char('*')}, QDir::Files, QDir::Time);
+    for (const QString &fileName : fileNames) {
+        QFile file(directory.filePath(fileName));
+        if (!file.open(QIODevice::ReadOnly) || file.size() < static_cast<qint64>(sizeof(DiskCacheHeader))) {
+            continue;
+        }
+        const uchar *data = file.map(0, file.size());
+        if (!data) {
+            continue;
+        }
+
+        DiskCacheHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        const qint64 fingerprintSize = static_cast<qint64>(header.fingerprintWidth) * header.fingerprintHeight * 4;
+        const qint64 imageSize = static_cast<qint64>(header.width) * header.height * 4;
+        if (header.magic != s_diskCacheMagic || header.version != s_diskCacheVersion
+            || file.size() != static_cast<qint64>(sizeof(header)) + fingerprintSize + imageSize
+            || QSize(header.fingerprintWidth, header.fingerprintHeight) != fingerprint.size()) {
+            continue;
+        }
+
+        const QImage storedFingerprint(data + sizeof(header), header.fingerprintWidth, header.fingerprintHeight, QImage::Format_RGBA8888);
+        if (!fingerprint.isNull() && fingerprintDifference(fingerprint, storedFingerprint) > maxDifference) {
+            continue;
+        }
+
+        // The image points to the mapped file, which stays mapped until the file is closed after the upload.
+        const QImage image(data + sizeof(header) + fingerprintSize, header.width, header.height, QImage::Format_RGBA8888);
+        return GLTexture::upload(image);
+    }
+    return nullptr;
+}
+
+void StaticBlurDiskCache::store(const QByteArray &key, const QImage &fingerprint, const QImage &image) const
+{
+    const QString prefix = filePrefix(key);
+    const QString fingerprintHash = QString::fromLatin1(QCryptographicHash::hash(QByteArrayView(fingerprint.constBits(), fingerprint.sizeInBytes()), QCryptographicHash::Sha1).toHex());
+    const QString directory = m_directory;
+    QThreadPool::globalInstance()->start([directory, prefix, fingerprintHash, fingerprint, texture = image]() {
+        const QImage image = texture.convertToFormat(QImage::Format_RGBA8888);
+        if (!QDir().mkpath(directory)) {
+            return;
+        }
+
+        QSaveFile file(directory + QLatin1Char('/') + prefix + fingerprintHash);
+        if (!file.open(QIODevice::WriteOnly)) {
+            return;
+        }
+        const DiskCacheHeader header{
+            s_diskCacheMagic,
+            s_diskCacheVersion,
+            static_cast<quint32>(image.width()),
+            static_cast<quint32>(image.height()),
+            static_cast<quint32>(fingerprint.width()),
+            static_cast<quint32>(fingerprint.height()),
+        };
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (int y = 0; y < fingerprint.height(); ++y) {
+            file.write(reinterpret_cast<const char *>(fingerprint.constScanLine(y)), fingerprint.width() * 4);
+        }
+        for (int y = 0; y < image.height(); ++y) {
+            file.write(reinterpret_cast<const char *>(image.constScanLine(y)), image.width() * 4);
+        }
+        if (!file.commit()) {
+            return;
+        }
+
+        // Outputs with different sizes and wallpapers store files of different sizes, so the limit is on the total.
+        // Files that are still being written by other stores aren't counted or removed.
+        const QDir cacheDirectory(directory);
+        QFileInfoList files = cacheDirectory.entryInfoList(QDir::Files, QDir::Time);
+        files.removeIf([](const QFileInfo &info) {
+            return !isCacheFileName(info.fileName());
+        });
+        qint64 size = 0;
+        for (qsizetype i = 0; i < files.size(); ++i) {
+            size += files[i].size();
+            if (i > 0 && size > s_maxDiskCacheSize) {
+                QFile::remove(files[i].filePath());
+            }
+        }
+    });
+}
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "opengl/glutils.h"
+
+#include <QImage>
+#include <QSize>
+
+#include <list>
+#include <memory>
+
+namespace KWin
+{
+
+/**
+ * Recently used static blur textures, so that switching between desktops or activities with different wallpapers, or
+ * showing the same wallpaper on multiple outputs, doesn't require rendering and blurring it again.
+ *
+ * Textures are identified by their size and format and by a fingerprint of the desktop they were created from, which is
+ * null for custom images. They are shared with the outputs using them, and evicted in least recently used order when
+ * the total size exceeds the budget. Evicting a texture that is still in use only drops the cache's reference.
+ */
+class StaticBlurCache
+{
+public:
+    struct Key
+    {
+        /// The size of the covered area in device pixels.
+        QSize size;
+        qreal scale = 1;
+        GLenum format = GL_RGBA8;
+
+        bool operator==(const Key &) const = default;
+    };
+
+    /**
+     * @param maxDifference The largest fingerprint difference at which a texture is considered a match.
+     * @return The texture, or nullptr if there is none.
+     */
+    std::shared_ptr<GLTexture> find(const Key &key, const QImage &fingerprint, int maxDifference);
+    void insert(const Key &key, const QImage &fingerprint, const std::shared_ptr<GLTexture> &texture);
+    bool contains(const GLTexture *texture) const;
+    void clear();
+
+    /**
+     * @param budget The maximum total size of the textures in bytes. 0 disables the cache.
+     */
+    void setBudget(qint64 budget);
+
+    /**
+     * @return The largest average difference of a color channel in any 8x8 cell of the fingerprints, from 0 to 255.
+     * The fingerprints must have the same size and the RGBA8888 format.
+     */
+    static int fingerprintDifference(const QImage &a, const QImage &b);
+
+private:
+    struct Entry
+    {
+        Key key;
+        QImage fingerprint;
+        std::shared_ptr<GLTexture> texture;
+        qint64 size;
+    };
+
+    void evict();
+
+    /// Most recently used first.
+    std::list<Entry> m_entries;
+    qint64 m_budget = 0;
+    qint64 m_size = 0;
+};
+
+/**
+ * Static blur textures stored in the cache directory, so that they don't need to be created again after the session or
+ * the compositor is restarted. Only RGBA8 textures are stored.
+ *
+ * Each file contains a small header, the fingerprint and the texture rows in the order they are stored in the texture.
+ * Files are memory mapped when loaded, and converted and written in a background thread. The oldest files are removed
+ * when the files take up too much space.
+ */
+class StaticBlurDiskCache
+{
+public:
+    StaticBlurDiskCache();
+
+    /**
+     * @param key Identifies the settings, output and image the texture was created for. Only files with the same key
+     * are considered.
+     * @param maxDifference The largest fingerprint difference at which a file is considered a match.
+     * @return The texture, or nullptr if no file matched.
+     */
+    std::unique_ptr<GLTexture> load(const QByteArray &key, const QImage &fingerprint, int maxDifference) const;
+    /**
+     * @param image The contents of the texture. It's converted to the RGBA8888 format in the background thread.
+     */
+    void store(const QByteArray &key, const QImage &fingerprint, const QImage &image) const;
+
+private:
+    QString m_directory;
+};
+
+}
@@ -0,0 +1,79 @@
+#include "staticblurimage.h"
+
+#include <QImageReader>
+#include <QtConcurrent>
+
+#include <algorithm>
+
+namespace KWin
+{
+
+static const int s_maxImages = 4;
+
+/**
+ * Runs in a worker thread.
+ */
+static QImage loadImage(const QString &path, const QSize &size, const CpuBlurParameters &blur)
+{
+    QImageReader reader(path);
+    reader.setAutoTransform(true);
+    const QImage image = reader.read();
+    if (image.isNull()) {
+        return QImage();
+    }
+    const QImage scaled = image.scaled(size, Qt::AspectRatioMode::IgnoreAspectRatio, Qt::TransformationMode::SmoothTransformation);
+    return cpuBlur(scaled, blur);
+}
+
+QImage StaticBlurImageLoader::image(const QString &path, const QDateTime &lastModified, const QSize &size, const CpuBlurParameters &blur)
+{
+    const Key key{path, lastModified, size, blur};
+    for (auto it = m_images.begin(); it != m_images.end(); ++it) {
+        if (it->key == key) {
+            m_images.splice(m_images.begin(), m_images, it);
+            return m_images.front().image;
+        }
+    }
+
+    const bool pending = std::any_of(m_jobs.begin(), m_jobs.end(), [&key](const Job &job) {
+        return job.key == key;
+    });
+    if (!pending) {
+        auto watcher = std::make_unique<QFutureWatcher<QImage>>();
+        connect(watcher.get(), &QFutureWatcher<QImage>::finished, this, [this, watcher = watcher.get()]() {
+            finish(watcher);
+        });
+        watcher->setFuture(QtConcurrent::run(loadImage, path, size, blur));
+        m_jobs.push_back(Job{key, std::move(watcher)});
+    }
+    return QImage();
+}
+
+void StaticBlurImageLoader::finish(QFutureWatcher<QImage> *watcher)
+{
+    const auto it = std::find_if(m_jobs.begin(), m_jobs.end(), [watcher](const Job &job) {
+        return job.watcher.get() == watcher;
+    });
+    if (it == m_jobs.end()) {
+        return;
+    }
+
+    // Images that couldn't be decoded are stored as well, so that the file isn't decoded again every frame.
+    m_images.push_front(Entry{it->key, watcher->result()});
+    if (m_images.size() > s_maxImages) {
+        m_images.pop_back();
+    }
+    // The watcher is emitting the signal that this is called from.
+    it->watcher.release()->deleteLater();
+    m_jobs.erase(it);
+
+    Q_EMIT imageLoaded();
+}
+
+void StaticBlurImageLoader::clear()
+{
+    m_images.clear();
+    m_jobs.clear();
+}
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "cpublur.h"
+
+#include <QDateTime>
+#include <QFutureWatcher>
+#include <QImage>
+#include <QObject>
+#include <QSize>
+#include <QString>
+
+#include <list>
+#include <memory>
+
+namespace KWin
+{
+
+/**
+ * Decodes the custom static blur image and scales it to the sizes of the outputs in a worker thread, so that large
+ * images don't stall the compositor. The images can be blurred there as well.
+ *
+ * Scaled images are identified by the path and modification time of the file, by their size and by how they are
+ * blurred. The most recently used ones are kept, so that outputs with the same size and recreating the textures don't
+ * require decoding the file again.
+ */
+class StaticBlurImageLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @param blur How the image is blurred after it's scaled. Blurring with no iterations is skipped.
+     * @return The image in the RGBA8888 format, or a null image if it isn't ready yet or couldn't be decoded. In the
+     * former case, loading is started and imageLoaded is emitted when it's done.
+     */
+    QImage image(const QString &path, const QDateTime &lastModified, const QSize &size, const CpuBlurParameters &blur = {});
+    void clear();
+
+Q_SIGNALS:
+    void imageLoaded();
+
+private:
+    struct Key
+    {
+        QString path;
+        QDateTime lastModified;
+        QSize size;
+        CpuBlurParameters blur;
+
+        bool operator==(const Key &) const = default;
+    };
+
+    struct Entry
+    {
+        Key key;
+        QImage image;
+    };
+
+    struct Job
+    {
+        Key key;
+        std::unique_ptr<QFutureWatcher<QImage>> watcher;
+    };
+
+    void finish(QFutureWatcher<QImage> *watcher);
+
+    /// Most recently used first.
+    std::list<Entry> m_images;
+    std::list<Job> m_jobs;
+};
+
+}
@@ -0,0 +1,95 @@
+#include "texturereadback.h"
+
+#include <cstring>
+#include <utility>
+
+namespace KWin
+{
+
+bool hasFenceSync()
+{
+    static const bool supported = epoxy_is_desktop_gl()
+        ? epoxy_gl_version() >= 32 || epoxy_has_gl_extension("GL_ARB_sync")
+        : epoxy_gl_version() >= 30;
+    return supported;
+}
+
+bool hasPixelBufferObjects()
+{
+    static const bool supported = epoxy_is_desktop_gl()
+        ? epoxy_gl_version() >= 30 || epoxy_has_gl_extension("GL_ARB_map_buffer_range")
+        : epoxy_gl_version() >= 30;
+    return supported;
+}
+
+std::unique_ptr<TextureReadback> TextureReadback::start(GLTexture *texture)
+{
+    if (!texture) {
+        return nullptr;
+    }
+
+    std::unique_ptr<TextureReadback> readback(new TextureReadback());
+    readback->m_size = texture->size();
+    if (!hasPixelBufferObjects() || !hasFenceSync()) {
+        readback->m_image = texture->toImage();
+        if (readback->m_image.isNull()) {
+            return nullptr;
+        }
+        return readback;
+    }
+
+    GLFramebuffer framebuffer(texture);
+    if (!framebuffer.valid()) {
+        return nullptr;
+    }
+
+    const qsizetype size = static_cast<qsizetype>(texture->width()) * texture->height() * 4;
+    glGenBuffers(1, &readback->m_buffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->m_buffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+
+    GLFramebuffer::pushFramebuffer(&framebuffer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, texture->width(), texture->height(), GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    GLFramebuffer::popFramebuffer();
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readback->m_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    return readback;
+}
+
+TextureReadback::~TextureReadback()
+{
+    if (m_fence) {
+        glDeleteSync(m_fence);
+    }
+    if (m_buffer) {
+        glDeleteBuffers(1, &m_buffer);
+    }
+}
+
+bool TextureReadback::isReady() const
+{
+    return !m_fence || glClientWaitSync(m_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) != GL_TIMEOUT_EXPIRED;
+}
+
+QImage TextureReadback::take()
+{
+    if (!m_buffer) {
+        return std::exchange(m_image, QImage());
+    }
+
+    QImage image(m_size, QImage::Format_RGBA8888_Premultiplied);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_buffer);
+    const void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, image.sizeInBytes(), GL_MAP_READ_BIT);
+    if (data) {
+        std::memcpy(image.bits(), data, image.sizeInBytes());
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        image = QImage();
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return image;
+}
+
+}
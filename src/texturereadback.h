@@ -0,0 +1,51 @@
+#pragma once
+
+#include "opengl/glutils.h"
+
+#include <QImage>
+
+#include <memory>
+
+namespace KWin
+{
+
+bool hasFenceSync();
+bool hasPixelBufferObjects();
+
+/**
+ * Copies a texture to a pixel buffer object without waiting for the GPU. The pixels can be taken once the copy is
+ * complete, which is usually the case in the next frame, so that reading back a texture doesn't stall the compositor.
+ * If pixel buffer objects or fences aren't supported, the texture is read synchronously when the readback is started.
+ *
+ * The object owns GL resources, the context must be current when it's started, taken and destroyed.
+ */
+class TextureReadback
+{
+public:
+    /**
+     * @return The readback, or nullptr if the texture is null or reading it failed.
+     */
+    static std::unique_ptr<TextureReadback> start(GLTexture *texture);
+    ~TextureReadback();
+
+    /**
+     * @return Whether the GPU finished copying the texture, in which case take() doesn't block.
+     */
+    bool isReady() const;
+    /**
+     * @return The pixels in the RGBA8888_Premultiplied format, in the same row order as GLTexture::toImage(). Null if
+     * the buffer couldn't be mapped. Blocks if the copy isn't complete yet.
+     */
+    QImage take();
+
+private:
+    TextureReadback() = default;
+
+    QSize m_size;
+    GLuint m_buffer = 0;
+    GLsync m_fence = nullptr;
+    /// Used if the texture was read synchronously.
+    QImage m_image;
+};
+
+}
@@ -0,0 +1,233 @@
+#include "tileregion.h"
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace KWin
+{
+
+static uint64_t bitRange(int first, int last)
+{
+    // Bits [first, last] of a word, 0 <= first <= last <= 63.
+    const uint64_t upper = last == 63 ? ~uint64_t(0) : (uint64_t(1) << (last + 1)) - 1;
+    return upper & ~((uint64_t(1) << first) - 1);
+}
+
+TileRegion::TileRegion(const QRect &bounds, const QRegion &region, Rounding rounding)
+{
+    reset(bounds);
+    for (const QRect &rect : region) {
+        if (const QRect tiles = tileRect(rect, rounding); !tiles.isEmpty()) {
+            setBits(tiles, true);
+        }
+    }
+}
+
+void TileRegion::reset(const QRect &bounds)
+{
+    m_bounds = bounds;
+    m_columns = (bounds.width() + TileSize - 1) / TileSize;
+    m_rows = (bounds.height() + TileSize - 1) / TileSize;
+    m_wordsPerRow = (m_columns + 63) / 64;
+    m_words.assign(static_cast<size_t>(m_wordsPerRow) * m_rows, 0);
+}
+
+const QRect &TileRegion::bounds() const
+{
+    return m_bounds;
+}
+
+bool TileRegion::isEmpty() const
+{
+    return std::all_of(m_words.begin(), m_words.end(), [](uint64_t word) {
+        return word == 0;
+    });
+}
+
+QRect TileRegion::tileRect(const QRect &rect, Rounding rounding) const
+{
+    const QRect clipped = rect.intersected(m_bounds).translated(-m_bounds.topLeft());
+    if (clipped.isEmpty()) {
+        return QRect();
+    }
+
+    // Tiles on the edges of the bounds may be partial, they count as fully covered if the rect reaches the edge.
+    const int right = clipped.x() + clipped.width();
+    const int bottom = clipped.y() + clipped.height();
+    if (rounding == Rounding::Outwards) {
+        return QRect(QPoint(clipped.x() / TileSize, clipped.y() / TileSize),
+                     QPoint((right - 1) / TileSize, (bottom - 1) / TileSize));
+    }
+
+    const int left = (clipped.x() + TileSize - 1) / TileSize;
+    const int top = (clipped.y() + TileSize - 1) / TileSize;
+    const int lastColumn = (right == m_bounds.width() ? m_columns : right / TileSize) - 1;
+    const int lastRow = (bottom == m_bounds.height() ? m_rows : bottom / TileSize) - 1;
+    if (lastColumn < left || lastRow < top) {
+        return QRect();
+    }
+    return QRect(QPoint(left, top), QPoint(lastColumn, lastRow));
+}
+
+void TileRegion::setBits(const QRect &tiles, bool value)
+{
+    const int firstWord = tiles.left() / 64;
+    const int lastWord = tiles.right() / 64;
+    for (int row = tiles.top(); row <= tiles.bottom(); row++) {
+        uint64_t *words = m_words.data() + static_cast<size_t>(row) * m_wordsPerRow;
+        for (int word = firstWord; word <= lastWord; word++) {
+            const int first = word == firstWord ? tiles.left() % 64 : 0;
+            const int last = word == lastWord ? tiles.right() % 64 : 63;
+            if (value) {
+                words[word] |= bitRange(first, last);
+            } else {
+                words[word] &= ~bitRange(first, last);
+            }
+        }
+    }
+}
+
+bool TileRegion::testBits(const QRect &tiles) const
+{
+    const int firstWord = tiles.left() / 64;
+    const int lastWord = tiles.right() / 64;
+    for (int row = tiles.top(); row <= tiles.bottom(); row++) {
+        const uint64_t *words = m_words.data() + static_cast<size_t>(row) * m_wordsPerRow;
+        for (int word = firstWord; word <= lastWord; word++) {
+            const int first = word == firstWord ? tiles.left() % 64 : 0;
+            const int last = word == lastWord ? tiles.right() % 64 : 63;
+            if (words[word] & bitRange(first, last)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool TileRegion::intersects(const QRegion &region) const
+{
+    for (const QRect &rect : region) {
+        if (const QRect tiles = tileRect(rect, Rounding::Outwards); !tiles.isEmpty() && testBits(tiles)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+TileRegion &TileRegion::operator+=(const QRegion &region)
+{
+    for (const QRect &rect : region) {
+        if (const QRect tiles = tileRect(rect, Rounding::Outwards); !tiles.isEmpty()) {
+            setBits(tiles, true);
+        }
+    }
+    return *this;
+}
+
+TileRegion &TileRegion::operator-=(const QRegion &region)
+{
+    for (const QRect &rect : region) {
+        if (const QRect tiles = tileRect(rect, Rounding::Inwards); !tiles.isEmpty()) {
+            setBits(tiles, false);
+        }
+    }
+    return *this;
+}
+
+bool TileRegion::compatible(const TileRegion &other) const
+{
+    return m_bounds == other.m_bounds;
+}
+
+TileRegion &TileRegion::operator|=(const TileRegion &other)
+{
+    if (!compatible(other)) {
+        return *this += other.toRegion();
+    }
+
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= m_words.size(); i += 2) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(m_words.data() + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(other.m_words.data() + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(m_words.data() + i), _mm_or_si128(a, b));
+    }
+#endif
+    for (; i < m_words.size(); i++) {
+        m_words[i] |= other.m_words[i];
+    }
+    return *this;
+}
+
+TileRegion &TileRegion::operator-=(const TileRegion &other)
+{
+    if (!compatible(other)) {
+        return *this -= other.toRegion();
+    }
+
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= m_words.size(); i += 2) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(m_words.data() + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(other.m_words.data() + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(m_words.data() + i), _mm_andnot_si128(b, a));
+    }
+#endif
+    for (; i < m_words.size(); i++) {
+        m_words[i] &= ~other.m_words[i];
+    }
+    return *this;
+}
+
+bool TileRegion::intersects(const TileRegion &other) const
+{
+    if (!compatible(other)) {
+        return intersects(other.toRegion());
+    }
+
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= m_words.size(); i += 2) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(m_words.data() + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(other.m_words.data() + i));
+        const __m128i both = _mm_and_si128(a, b);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(both, _mm_setzero_si128())) != 0xffff) {
+            return true;
+        }
+    }
+#endif
+    for (; i < m_words.size(); i++) {
+        if (m_words[i] & other.m_words[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QRegion TileRegion::toRegion() const
+{
+    QRegion region;
+    for (int row = 0; row < m_rows; row++) {
+        const uint64_t *words = m_words.data() + static_cast<size_t>(row) * m_wordsPerRow;
+        int column = 0;
+        while (column < m_columns) {
+            if (!(words[column / 64] & (uint64_t(1) << (column % 64)))) {
+                column++;
+                continue;
+            }
+
+            const int start = column;
+            while (column < m_columns && (words[column / 64] & (uint64_t(1) << (column % 64)))) {
+                column++;
+            }
+            region += QRect(m_bounds.x() + start * TileSize, m_bounds.y() + row * TileSize, (column - start) * TileSize, TileSize)
+                          .intersected(m_bounds);
+        }
+    }
+    return region;
+}
+
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <QRect>
+#include <QRegion>
+
+#include <cstdint>
+#include <vector>
+
+namespace KWin
+{
+
+/**
+ * Coarse alternative to QRegion for damage bookkeeping. The area within the bounds is split into fixed-size tiles,
+ * every row of tiles is stored as a bitset, so that union, subtraction and intersection tests are done a word at a
+ * time instead of rect by rect.
+ *
+ * The represented area is always a superset of the exact one: adding marks every touched tile, subtracting only
+ * clears tiles that are fully covered. Anything outside of the bounds is ignored.
+ */
+class TileRegion
+{
+public:
+    static constexpr int TileSize = 16;
+
+    enum class Rounding
+    {
+        /// Every tile touched by a rect.
+        Outwards,
+        /// Only tiles fully covered by a single rect.
+        Inwards
+    };
+
+    TileRegion() = default;
+    /**
+     * Converts the region once, so that it can be combined with other tile regions with the same bounds a word at a
+     * time.
+     */
+    TileRegion(const QRect &bounds, const QRegion &region, Rounding rounding);
+
+    /// Clears the region and sets its bounds, usually the geometry of the output being painted.
+    void reset(const QRect &bounds);
+    const QRect &bounds() const;
+
+    bool isEmpty() const;
+    bool intersects(const QRegion &region) const;
+    bool intersects(const TileRegion &other) const;
+
+    TileRegion &operator+=(const QRegion &region);
+    TileRegion &operator-=(const QRegion &region);
+    TileRegion &operator|=(const TileRegion &other);
+    TileRegion &operator-=(const TileRegion &other);
+
+    QRegion toRegion() const;
+
+private:
+    /// @return The rect in tile coordinates, possibly empty.
+    QRect tileRect(const QRect &rect, Rounding rounding) const;
+    void setBits(const QRect &tiles, bool value);
+    bool testBits(const QRect &tiles) const;
+    bool compatible(const TileRegion &other) const;
+
+    QRect m_bounds;
+    int m_columns = 0;
+    int m_rows = 0;
+    int m_wordsPerRow = 0;
+    std::vector<uint64_t> m_words;
+};
+
+/*
+ * These let the damage bookkeeping in prePaintWindow be written once for both QRegion and TileRegion. With QRegion,
+ * they return the region as it is. With TileRegion, each region of a window is converted once and then combined with
+ * the accumulated regions a word at a time.
+ */
+
+/// @return The area touched by the region, for adding and intersection tests.
+inline const QRegion &damageArea(const QRegion &, const QRegion &region)
+{
+    return region;
+}
+
+inline TileRegion damageArea(const TileRegion &accumulated, const QRegion &region)
+{
+    return TileRegion(accumulated.bounds(), region, TileRegion::Rounding::Outwards);
+}
+
+/// @return The area covered by the region, for subtraction.
+inline const QRegion &coveredArea(const QRegion &, const QRegion &region)
+{
+    return region;
+}
+
+inline TileRegion coveredArea(const TileRegion &accumulated, const QRegion &region)
+{
+    return TileRegion(accumulated.bounds(), region, TileRegion::Rounding::Inwards);
+}
+
+inline const QRegion &toRegion(const QRegion &region)
+{
+    return region;
+}
+
+inline QRegion toRegion(const TileRegion &region)
+{
+    return region.toRegion();
+}
+
+}
@@ -0,0 +1,56 @@
+#include "windowclassmatcher.h"
+
+namespace KWin
+{
+
+void WindowClassMatcher::clear()
+{
+    m_exact.clear();
+    m_patterns.clear();
+    m_expression = QRegularExpression();
+}
+
+void WindowClassMatcher::add(const QString &pattern)
+{
+    if (pattern.size() > 2 && pattern.startsWith(QChar('/')) && pattern.endsWith(QChar('/'))) {
+        const auto expression = pattern.mid(1, pattern.size() - 2);
+        if (QRegularExpression(expression).isValid()) {
+            m_patterns << QRegularExpression::anchoredPattern(expression);
+        }
+    } else if (pattern.contains(QChar('*')) || pattern.contains(QChar('?'))) {
+        m_patterns << QRegularExpression::wildcardToRegularExpression(pattern, QRegularExpression::NonPathWildcardConversion);
+    } else {
+        m_exact.insert(pattern);
+    }
+}
+
+void WindowClassMatcher::compile()
+{
+    if (m_patterns.isEmpty()) {
+        m_expression = QRegularExpression();
+        return;
+    }
+
+    m_expression = QRegularExpression(QStringLiteral("(?:") + m_patterns.join(QStringLiteral(")|(?:")) + QStringLiteral(")"));
+    m_expression.optimize();
+}
+
+bool WindowClassMatcher::matches(const QString &windowClass) const
+{
+    if (m_exact.contains(windowClass)) {
+        return true;
+    }
+    return !m_patterns.isEmpty() && m_expression.match(windowClass).hasMatch();
+}
+
+bool WindowClassMatcher::isEmpty() const
+{
+    return m_exact.isEmpty() && m_patterns.isEmpty();
+}
+
+bool WindowClassMatcher::operator==(const WindowClassMatcher &other) const
+{
+    return m_exact == other.m_exact && m_patterns == other.m_patterns;
+}
+
+}
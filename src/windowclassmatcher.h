@@ -0,0 +1,33 @@
+#pragma once
+
+#include <QRegularExpression>
+#include <QSet>
+#include <QStringList>
+
+namespace KWin
+{
+
+/**
+ * Matches window classes against a list of patterns. Plain patterns are stored in a hash set, glob (containing * or ?)
+ * and regular expression (enclosed in slashes) patterns are compiled into a single regular expression.
+ */
+class WindowClassMatcher
+{
+public:
+    void clear();
+    void add(const QString &pattern);
+    /// Must be called after all patterns have been added.
+    void compile();
+
+    bool matches(const QString &windowClass) const;
+    bool isEmpty() const;
+
+    bool operator==(const WindowClassMatcher &other) const;
+
+private:
+    QSet<QString> m_exact;
+    QStringList m_patterns;
+    QRegularExpression m_expression;
+};
+
+}
@@ -0,0 +1,108 @@
+#include "windowgrid.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace KWin
+{
+
+static const int s_cellSize = 256;
+
+static int cellIndex(int coordinate)
+{
+    return static_cast<int>(std::floor(static_cast<double>(coordinate) / s_cellSize));
+}
+
+qint64 WindowGrid::cellKey(int x, int y)
+{
+    return (static_cast<qint64>(x) << 32) | static_cast<quint32>(y);
+}
+
+void WindowGrid::update(EffectWindow *window, const QRect &geometry)
+{
+    if (auto it = m_geometries.find(window); it != m_geometries.end()) {
+        if (it->second == geometry) {
+            return;
+        }
+        removeFromCells(window, it->second);
+        it->second = geometry;
+    } else {
+        m_geometries.emplace(window, geometry);
+    }
+    insertIntoCells(window, geometry);
+}
+
+void WindowGrid::remove(EffectWindow *window)
+{
+    if (auto it = m_geometries.find(window); it != m_geometries.end()) {
+        removeFromCells(window, it->second);
+        m_geometries.erase(it);
+    }
+}
+
+void WindowGrid::clear()
+{
+    m_geometries.clear();
+    m_cells.clear();
+}
+
+std::vector<EffectWindow *> WindowGrid::query(const QRect &rect) const
+{
+    std::vector<EffectWindow *> windows;
+    if (rect.isEmpty()) {
+        return windows;
+    }
+
+    for (int x = cellIndex(rect.left()); x <= cellIndex(rect.right()); x++) {
+        for (int y = cellIndex(rect.top()); y <= cellIndex(rect.bottom()); y++) {
+            const auto cell = m_cells.find(cellKey(x, y));
+            if (cell == m_cells.end()) {
+                continue;
+            }
+
+            for (EffectWindow *window : cell->second) {
+                if (std::find(windows.begin(), windows.end(), window) == windows.end()
+                    && m_geometries.at(window).intersects(rect)) {
+                    windows.push_back(window);
+                }
+            }
+        }
+    }
+    return windows;
+}
+
+void WindowGrid::insertIntoCells(EffectWindow *window, const QRect &geometry)
+{
+    if (geometry.isEmpty()) {
+        return;
+    }
+
+    for (int x = cellIndex(geometry.left()); x <= cellIndex(geometry.right()); x++) {
+        for (int y = cellIndex(geometry.top()); y <= cellIndex(geometry.bottom()); y++) {
+            m_cells[cellKey(x, y)].push_back(window);
+        }
+    }
+}
+
+void WindowGrid::removeFromCells(EffectWindow *window, const QRect &geometry)
+{
+    if (geometry.isEmpty()) {
+        return;
+    }
+
+    for (int x = cellIndex(geometry.left()); x <= cellIndex(geometry.right()); x++) {
+        for (int y = cellIndex(geometry.top()); y <= cellIndex(geometry.bottom()); y++) {
+            const auto cell = m_cells.find(cellKey(x, y));
+            if (cell == m_cells.end()) {
+                continue;
+            }
+
+            std::erase(cell->second, window);
+            if (cell->second.empty()) {
+                m_cells.erase(cell);
+            }
+        }
+    }
+}
+
+}
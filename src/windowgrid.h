@@ -0,0 +1,38 @@
+#pragma once
+
+#include <QRect>
+
+#include <unordered_map>
+#include <vector>
+
+namespace KWin
+{
+
+class EffectWindow;
+
+/**
+ * Uniform grid of window geometries for quickly finding windows that intersect a rectangle. Windows are updated
+ * individually when their geometry changes.
+ */
+class WindowGrid
+{
+public:
+    void update(EffectWindow *window, const QRect &geometry);
+    void remove(EffectWindow *window);
+    void clear();
+
+    /**
+     * @return Windows whose geometry intersects the specified rectangle. Every window is returned at most once.
+     */
+    std::vector<EffectWindow *> query(const QRect &rect) const;
+
+private:
+    static qint64 cellKey(int x, int y);
+    void insertIntoCells(EffectWindow *window, const QRect &geometry);
+    void removeFromCells(EffectWindow *window, const QRect &geometry);
+
+    std::unordered_map<EffectWindow *, QRect> m_geometries;
+    std::unordered_map<qint64, std::vector<EffectWindow *>> m_cells;
+};
+
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+namespace KWin
+{
+
+class EffectWindow;
+
+/**
+ * Per-window state stored in slots with stable indices. A slot is assigned when a window is inserted and reused after
+ * the window is removed.
+ *
+ * Records hold state that is only accessed when something about the window changes. Flags that are read every frame
+ * are stored in a separate packed array, so that iterating over them doesn't touch the records.
+ *
+ * Looking up a window requires a hash lookup, but the last result is cached, since the same window is usually looked up
+ * several times in a row while it's being painted. The index isn't stored on the window, since EffectWindow::data is a
+ * hash lookup as well, and wraps the value in a QVariant. See benchmarks/windowtablebenchmark.cpp.
+ */
+template<typename Record>
+class WindowTable
+{
+public:
+    using Index = uint32_t;
+    static constexpr Index InvalidIndex = std::numeric_limits<Index>::max();
+
+    /**
+     * @return The index of the window, or InvalidIndex if it's not in the table.
+     */
+    Index find(const EffectWindow *window) const
+    {
+        if (window == m_lastWindow) {
+            return m_lastIndex;
+        }
+
+        const auto it = m_indices.find(window);
+        const Index index = it != m_indices.end() ? it->second : InvalidIndex;
+        m_lastWindow = window;
+        m_lastIndex = index;
+        return index;
+    }
+
+    /**
+     * Inserts the window if it's not in the table yet.
+     * @return The index of the window.
+     */
+    Index insert(EffectWindow *window)
+    {
+        if (const Index existing = find(window); existing != InvalidIndex) {
+            return existing;
+        }
+
+        Index index;
+        if (!m_freeSlots.empty()) {
+            index = m_freeSlots.back();
+            m_freeSlots.pop_back();
+            m_windows[index] = window;
+            m_records[index] = Record();
+            m_flags[index] = 0;
+        } else {
+            index = static_cast<Index>(m_windows.size());
+            m_windows.push_back(window);
+            m_records.emplace_back();
+            m_flags.push_back(0);
+        }
+
+        m_indices.emplace(window, index);
+        m_lastWindow = window;
+        m_lastIndex = index;
+        return index;
+    }
+
+    void remove(const EffectWindow *window)
+    {
+        const Index index = find(window);
+        if (index == InvalidIndex) {
+            return;
+        }
+
+        m_indices.erase(window);
+        m_windows[index] = nullptr;
+        m_records[index] = Record();
+        m_flags[index] = 0;
+        m_freeSlots.push_back(index);
+        m_lastWindow = nullptr;
+        m_lastIndex = InvalidIndex;
+    }
+
+    /**
+     * @return The number of slots, including free ones. Free slots have no window.
+     */
+    Index slotCount() const
+    {
+        return static_cast<Index>(m_windows.size());
+    }
+
+    EffectWindow *window(Index index) const
+    {
+        return m_windows[index];
+    }
+
+    Record &record(Index index)
+    {
+        return m_records[index];
+    }
+
+    const Record &record(Index index) const
+    {
+        return m_records[index];
+    }
+
+    bool testFlag(Index index, uint8_t flag) const
+    {
+        return m_flags[index] & flag;
+    }
+
+    void setFlag(Index index, uint8_t flag, bool on = true)
+    {
+        if (on) {
+            m_flags[index] |= flag;
+        } else {
+            m_flags[index] &= ~flag;
+        }
+    }
+
+    /**
+     * Clears the specified flags of all windows.
+     */
+    void clearFlag(uint8_t flag)
+    {
+        for (uint8_t &flags : m_flags) {
+            flags &= ~flag;
+        }
+    }
+
+private:
+    std::vector<EffectWindow *> m_windows;
+    std::vector<Record> m_records;
+    std::vector<uint8_t> m_flags;
+    std::vector<Index> m_freeSlots;
+    std::unordered_map<const EffectWindow *, Index> m_indices;
+
+    mutable const EffectWindow *m_lastWindow = nullptr;
+    mutable Index m_lastIndex = InvalidIndex;
+};
+
+}